@@ -0,0 +1,164 @@
+#! /usr/bin/bash
+#
+# Multi-stream scaling benchmark (Linux, needs root)
+#
+#   generator ns --veth-- filter ns --veth-- sink ns
+#
+# For each stream count and each option variant, runs one tspidfilter
+# per stream in the filter namespace, drives them with tspidfilter -G
+# and measures them with tspidfilter -K. Prints one JSON object per
+# run: loss, throughput, latency percentiles and CPU per stream.
+#
+# With -m all streams go through a single tspidfilter in multi-route
+# mode (-r routes file), variants then typically compare worker counts
+# and scheduling, e.g. -m -v "-j 4;-j 4 -static".
+#
+# usage: bench.sh [-n "1 4 16"] [-r mbit_per_stream] [-d seconds]
+#                 [-p "hidden pids"] [-v "variant options;..."] [-m]
+
+BIN=$(realpath "$(dirname "$0")/tspidfilter")
+COUNTS="1 4 16"
+RATE=40
+DURATION=10
+PIDS="101 103"
+VARIANTS=""
+MULTI=0
+
+while getopts "n:r:d:p:v:m" opt; do
+    case $opt in
+        n) COUNTS=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        p) PIDS=$OPTARG ;;
+        v) VARIANTS=$OPTARG ;;
+        m) MULTI=1 ;;
+        *) echo "usage: $0 [-n counts] [-r mbit] [-d seconds] [-p pids] [-v 'opts;opts'] [-m]" >&2; exit 1 ;;
+    esac
+done
+
+NS_GEN=tsb_gen
+NS_DUT=tsb_dut
+NS_SINK=tsb_sink
+
+cleanup() {
+    for ns in $NS_GEN $NS_DUT $NS_SINK; do
+        ip netns pids $ns 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del $ns 2>/dev/null
+    done
+}
+
+setup() {
+    for ns in $NS_GEN $NS_DUT $NS_SINK; do
+        ip netns add $ns || exit 1
+        ip -n $ns link set lo up
+    done
+    ip link add g0 netns $NS_GEN type veth peer name d0 netns $NS_DUT
+    ip link add d1 netns $NS_DUT type veth peer name s0 netns $NS_SINK
+
+    ip -n $NS_GEN addr add 10.11.0.1/24 dev g0
+    ip -n $NS_DUT addr add 10.11.0.2/24 dev d0
+    ip -n $NS_DUT addr add 10.12.0.1/24 dev d1
+    ip -n $NS_SINK addr add 10.12.0.2/24 dev s0
+    for l in "$NS_GEN g0" "$NS_DUT d0" "$NS_DUT d1" "$NS_SINK s0"; do
+        set -- $l
+        ip -n $1 link set $2 up
+    done
+
+    # input groups 239.1/16 flow gen -> filter, output 239.2/16 filter -> sink
+    ip -n $NS_GEN route add 239.1.0.0/16 dev g0
+    ip -n $NS_DUT route add 239.1.0.0/16 dev d0
+    ip -n $NS_DUT route add 239.2.0.0/16 dev d1
+    ip -n $NS_SINK route add 239.2.0.0/16 dev s0
+    for ns in $NS_DUT $NS_SINK; do
+        ip netns exec $ns sysctl -qw net.ipv4.conf.all.rp_filter=0 net.ipv4.conf.default.rp_filter=0
+        ip netns exec $ns sysctl -qw net.ipv4.igmp_max_memberships=65536
+    done
+    ip netns exec $NS_DUT sysctl -qw net.ipv4.conf.d0.rp_filter=0
+    ip netns exec $NS_SINK sysctl -qw net.ipv4.conf.s0.rp_filter=0
+}
+
+# group i (from 0) above base
+group() {
+    local n=$(( $2 + 0 ))
+    echo "$1.$(( n / 256 )).$(( n % 256 ))"
+}
+
+# string as the body of a JSON string
+json_escape() {
+    local s=${1//\\/\\\\}
+    s=${s//\"/\\\"}
+    s=${s//$'\t'/\\t}
+    printf '%s' "$s"
+}
+
+# utime + stime of a list of pids, in clock ticks
+cpu_ticks() {
+    local total=0
+    for pid in "$@"; do
+        set -- $(sed 's/.*) //' /proc/$pid/stat 2>/dev/null)
+        total=$(( total + ${12:-0} + ${13:-0} ))
+    done
+    echo $total
+}
+
+run() {
+    local n=$1 variant=$2 pids=() i routes=""
+    if [ $MULTI = 1 ]; then
+        routes=$(mktemp)
+        for (( i = 0; i < n; i++ )); do
+            echo "$(group 239.1 $i) 5000 $(group 239.2 $i) 6000 $PIDS" >> "$routes"
+        done
+        ip netns exec $NS_DUT "$BIN" $variant -r "$routes" > /dev/null &
+        pids+=($!)
+    else
+        for (( i = 0; i < n; i++ )); do
+            ip netns exec $NS_DUT "$BIN" $variant $(group 239.1 $i) 5000 $(group 239.2 $i) 6000 $PIDS > /dev/null &
+            pids+=($!)
+        done
+    fi
+    sleep 0.5
+
+    local sink_out
+    sink_out=$(mktemp)
+    ip netns exec $NS_SINK "$BIN" -K 239.2.0.0 6000 $n $(( DURATION + 1 )) > "$sink_out" &
+    local sink=$!
+    sleep 0.3
+
+    local t0 c0 c1 t1
+    t0=$(date +%s.%N)
+    c0=$(cpu_ticks "${pids[@]}")
+    ip netns exec $NS_GEN "$BIN" -G 239.1.0.0 5000 $n $RATE $DURATION > /dev/null
+    c1=$(cpu_ticks "${pids[@]}")
+    t1=$(date +%s.%N)
+    wait $sink
+    kill "${pids[@]}" 2>/dev/null
+    wait "${pids[@]}" 2>/dev/null
+    [ -n "$routes" ] && rm -f "$routes"
+
+    local cpu
+    cpu=$(awk -v c=$(( c1 - c0 )) -v hz=$(getconf CLK_TCK) -v t="$t1 - $t0" -v n=$n \
+        'BEGIN { split(t, a, " - "); printf "%.3f", 100 * c / hz / (a[1] - a[2]) / n }')
+    local json
+    json=$(cat "$sink_out")
+    [ -n "$json" ] && printf '%s, "variant": "%s", "multi_route": %d, "mbit_per_stream": %s, "cpu_pct_per_stream": %s}\n' \
+        "${json%\}}" "$(json_escape "$variant")" $MULTI "$RATE" "$cpu"
+    rm -f "$sink_out"
+}
+
+if [ ! -x "$BIN" ]; then
+    echo "build tspidfilter first (build.sh)" >&2
+    exit 1
+fi
+
+trap cleanup EXIT
+cleanup
+setup
+
+IFS=';' read -ra variant_list <<< "${VARIANTS:-}"
+[ ${#variant_list[@]} -eq 0 ] && variant_list=("")
+
+for n in $COUNTS; do
+    for v in "${variant_list[@]}"; do
+        run $n "$v"
+    done
+done
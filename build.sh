@@ -1,3 +1,4 @@
 #! /usr/bin/bash
 
 gcc -Wall -Wextra -Werror  -O3 -o tspidfilter tspidfilter.cpp
+ln -sf tspidfilter tspidfilter-top
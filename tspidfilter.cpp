@@ -14,23 +14,65 @@
             - replace PID value by 8191 (NULL)
     - send patched (or not) datagram to another multicast socket
       (keep structure, RTP header if any,...)
+
+    File mode (-f in.ts out.ts):
+    - read the capture in large 188-byte-aligned blocks
+    - split each block in one slice per worker thread
+    - patch slices in parallel, write block back in order
 *************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS // fopen() in file mode
 #include <Winsock2.h> // before Windows.h, else Winsock 1 conflict
 #include <Ws2tcpip.h> // needed for ip_mreq definition for multicast
 #include <Windows.h>
+#include <iphlpapi.h> // if_nametoindex
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>     // if_nametoindex
+#include <ifaddrs.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <linux/sock_diag.h>    // SK_MEMINFO_DROPS
 #endif
 #include <time.h>
+#if defined(_MSC_VER)
+#include <intrin.h>     // __rdtsc
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc
+#endif
+
+// USDT probes for perf / bpftrace, compiled out without systemtap headers
+#if !defined(_WIN32) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a)         DTRACE_PROBE1(tspidfilter, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(tspidfilter, name, a, b)
+#endif
+#endif
+#ifndef PROBE1
+#define PROBE1(name, a)         do {} while (0)
+#define PROBE2(name, a, b)      do {} while (0)
+#endif
 
 //=======================================
 // Define multicast in and out
@@ -48,19 +90,154 @@ char* OutputInterface = NULL;
 unsigned short Pid2Patch[100] = { 0 };
 int Pid2PatchCount = 0;
 
+// File mode: patch a TS capture instead of a live multicast
+char* FileIn = NULL;
+char* FileOut = NULL;
+int Threads = 0;        // file mode and multi-route workers, 0 = one per CPU
+
+// PID inventory instead of patching (-A): window in s, 0 = whole capture
+int AnalyzeSeconds = -1;
+
+// Hot restart: Unix socket used to hand sockets and state to a new process
+char* HandoffPath = NULL;
+
+// Shared memory segment name for stats publication (-S), read by tspidfilter-top
+char* StatsShmName = NULL;
+
+// Measure pipeline stages with hardware counters every N datagrams (-P)
+int PerfEvery = 0;
+
+// Account TSC cycles per pipeline stage for every datagram (-C)
+int CycleAccounting = 0;
+
+// Network impairment profile applied between receive and patch (-I)
+char* ImpairProfile = NULL;
+
+// ETR 290 priority 1 and 2 checks on the input, in the patch pass (-E)
+int EtrMonitor = 0;
+
+// Per-PID content fingerprints of input and output, appended to this file (-F)
+char* FpFile = NULL;
+int FpBits = 10;
+
+// T2-MI PID whose inner TS packets are filtered too, and PLP (-1: all) (-T)
+int T2miPid = -1;
+int T2miPlp = -1;
+
+// Teletext pages, subtitle pages or languages blanked inside PIDs (-X)
+#define PES_MAX_PIDS 8
+char* PesSpec[PES_MAX_PIDS];
+int PesSpecCount = 0;
+
+// SFN MIP pointer and STS verification on input and output (-M)
+int MipCheck = 0;
+
+// PCR interval, accuracy and jitter against kernel receive timestamps (-J)
+int PcrJitter = 0;
+
+// Sampled monitor output: mcast:port:n or mcast:port:psi (-m)
+char* MonitorSpec = NULL;
+
+// Non-blocking output (-Q n[:head|tail][:ms]), 0: blocking sendto
+int SendQueueLen = 0;
+int SendQueueDropHead = 1;
+int SendQueueLateMs = 0;
+
+// Multi-route mode: one route per line of this file (-r), see run_routes()
+char* RoutesFile = NULL;
+int RoutesStatic = 0;   // no work stealing, routes stay on their home worker
+int LatencyTarget = 200;    // us a worker may wait to let datagrams batch up (-L)
+
 //=======================================
 // Global variables and definitions
 
 int fd_in = -1;
 int fd_out = -1;
-struct sockaddr_in addr_out;
+int fd_out6 = -1;   // multi-route mode, output to IPv6 groups
+
+// IPv4 or IPv6 socket address
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} Addr_t;
+
+Addr_t addr_out;
+
+// longest address spec given on the command line: source@group
+#define ADDR_SPEC_LEN   (2 * INET6_ADDRSTRLEN + 8)
+
+// Redundant outputs (-o given again): the same patched datagram also
+// leaves through each of these interfaces, SMPTE 2022-7 style, to
+// OutputMCast or to a group of its own
+#define OUTPUT_MAX 3
+typedef struct {
+    char* iface;
+    char* mcast;                // NULL: OutputMCast
+    int fd;
+    Addr_t addr;
+    unsigned long long int count_err;
+} Output_t;
+
+Output_t Outputs[OUTPUT_MAX];
+int OutputCount = 0;
 
 #define MSGBUFSIZE 1400
 unsigned char msgbuf[MSGBUFSIZE];
 
+typedef struct {
+    unsigned long long int count_udp;
+    unsigned long long int count_ts;
+    unsigned long long int count_patched;
+    unsigned long long int count_send_err;
+} Stats_t;
+
+Stats_t Stats = { 0, 0, 0, 0 };
+
 #define TS_LEN      188
 #define TS_SYNC     0x47
 #define PID_NULL    8191
+#define PID_COUNT   8192
+
+// per-PID packet counters, maintained by patch_ts() in live mode
+typedef struct {
+    unsigned long long int count_pid[PID_COUNT];
+    unsigned long long int count_sync_err;
+} PidStats_t;
+
+PidStats_t PidStats;
+
+// hardware counters per pipeline stage, sampled when -P is given
+#define STAGE_RECEIVE   0
+#define STAGE_PARSE     1
+#define STAGE_PATCH     2
+#define STAGE_SEND      3
+#define STAGE_COUNT     4
+
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_CACHE_MISSES   2
+#define PERF_COUNT          3
+
+typedef struct {
+    unsigned long long int samples;
+    unsigned long long int count[STAGE_COUNT][PERF_COUNT];
+} PerfStats_t;
+
+PerfStats_t PerfStats;
+
+// TSC cycles per pipeline stage, kept by the processing thread when -C
+// is given. tsc_start / time_start give the TSC rate for CPU shares.
+typedef struct {
+    unsigned long long int cycles[STAGE_COUNT];
+    unsigned long long int count[STAGE_COUNT];
+    unsigned long long int tsc_start;
+    unsigned long long int tsc_now;
+    double time_start;
+    double time_now;
+} CycleStats_t;
+
+CycleStats_t CycleStats;
 
 typedef struct {
     unsigned char sync : 8;
@@ -94,262 +271,6460 @@ void set_pid(TSHDR_t* p, unsigned int new_pid)
     p->pidH = new_pid >> 8;
 }
 
-int patch_ts(unsigned char* ts_buf, int n_ts)
+#define PCR_HZ      27000000ULL
+#define PCR_WRAP    ((1ULL << 33) * 300)
+
+// 1 if the packet carries a PCR, returned in 27 MHz units
+int get_pcr(unsigned char* ts, unsigned long long int* pcr)
 {
-    int n_patched = 0;
+    TSHDR_t* h = (TSHDR_t*)ts;
+    if (!(h->afc & 2) || ts[4] < 7 || !(ts[5] & 0x10))
+        return 0;
+    unsigned long long int base = ((unsigned long long int)ts[6] << 25) | (ts[7] << 17)
+        | (ts[8] << 9) | (ts[9] << 1) | (ts[10] >> 7);
+    *pcr = base * 300 + (((ts[10] & 1) << 8) | ts[11]);
+    return 1;
+}
 
-    for (; n_ts > 0; n_ts--, ts_buf += TS_LEN)
-    {
-        if (!check_sync((TSHDR_t*)ts_buf))
-        {
-            printf("sync error !\n");
-            continue;
-        }
+void set_pcr(unsigned char* ts, unsigned long long int pcr)
+{
+    unsigned long long int base = pcr / 300;
+    unsigned int ext = (unsigned int)(pcr % 300);
+    ts[6] = (unsigned char)(base >> 25);
+    ts[7] = (unsigned char)(base >> 17);
+    ts[8] = (unsigned char)(base >> 9);
+    ts[9] = (unsigned char)(base >> 1);
+    ts[10] = (unsigned char)(((base & 1) << 7) | 0x7E | (ext >> 8));
+    ts[11] = (unsigned char)ext;
+}
 
-        for (int i = 0; i < Pid2PatchCount; i++)
-        {
-            if (get_pid((TSHDR_t*)ts_buf) == Pid2Patch[i])
-            {
-                set_pid((TSHDR_t*)ts_buf, PID_NULL);
-                ++n_patched;
-                //break;
-            }
-        }
-    }
+//=======================================
+// ETR 290 priority 1 and 2 monitoring (-E, live mode)
+//
+// Checks run from patch_ts() on each packet, before its PID is patched,
+// so they see the input stream. Per-PID state lives in a compact table
+// (slot[pid] indexes at most ETR_MAX_PIDS entries) filled as PIDs show
+// up. PAT, CAT and PMT are parsed for PMT, elementary and PCR PIDs, and
+// CRC checked, when the section fits in the packet that starts it;
+// sections spanning packets are only used for repetition checks.
+// Timeouts (PAT, PMT, PID, PTS, CAT) are checked by etr_tick(), called
+// by the processing loop about every 100 ms. Each check has a counter
+// and an alarm, raised on the first error and cleared after
+// ETR_ALARM_HOLD seconds without one.
 
-    return n_patched;
+#define ETR_SYNC_LOSS   0
+#define ETR_SYNC_BYTE   1
+#define ETR_PAT         2
+#define ETR_CC          3
+#define ETR_PMT         4
+#define ETR_PID         5
+#define ETR_TRANSPORT   6
+#define ETR_CRC         7
+#define ETR_PCR_REP     8
+#define ETR_PCR_DISC    9
+#define ETR_PCR_ACC     10
+#define ETR_PTS         11
+#define ETR_CAT         12
+#define ETR_COUNT       13
+
+#define ETR_MAX_PIDS        128
+#define ETR_UNTRACKED       -2      // slot of a PID seen once the table was full
+#define ETR_ALARM_HOLD      5.0
+#define ETR_PID_TIMEOUT     5.0     // s without a referenced PID (1.6)
+#define ETR_PCR_REP_MAX     (PCR_HZ * 40 / 1000)
+#define ETR_PCR_DISC_MAX    (PCR_HZ / 10)
+#define ETR_PCR_ACC_MAX     13.5    // 500 ns in 27 MHz units
+
+typedef struct {
+    short pid;
+    signed char cc;             // last CC, -1 before the first packet
+    unsigned char cc_repeat;
+    unsigned char is_pmt, is_pcr, referenced, has_pts;
+    short owner;                // PMT PID listing it as ES or PCR, -1 none
+    signed char pmt_version;    // of the PMT on this PID, -1 none yet
+    double last_seen;
+    double last_table;          // PMT sections
+    double last_pts;
+    unsigned long long int pcr;         // last PCR
+    unsigned long long int pcr_pos;     // stream packet index of the last PCR
+    double pcr_ticks_per_packet;        // from the previous PCR interval, 0 if unknown
+} EtrPid_t;
+
+typedef struct {
+    double now;                 // set by the caller before patch_ts()
+    unsigned long long int pos; // packets seen
+    int bad_sync, good_sync, sync_lost;
+    double last_pat;
+    int pat_version;            // PMT PIDs below come from it, -1 none
+    int cat_seen, scrambled;
+    short slot[PID_COUNT];      // index in pids, -1 if not seen yet
+    EtrPid_t pids[ETR_MAX_PIDS];
+    int n_pids;
+    int n_untracked;            // PIDs not monitored, table full
+    unsigned long long int count[ETR_COUNT];
+    int alarm[ETR_COUNT];
+    double last_error[ETR_COUNT];
+    double last_tick;
+} Etr290_t;
+
+Etr290_t Etr;
+
+const char* etr_name[ETR_COUNT] = {
+    "1.1 TS_sync_loss", "1.2 Sync_byte_error", "1.3 PAT_error", "1.4 Continuity_count_error",
+    "1.5 PMT_error", "1.6 PID_error", "2.1 Transport_error", "2.2 CRC_error",
+    "2.3a PCR_repetition_error", "2.3b PCR_discontinuity_indicator_error", "2.4 PCR_accuracy_error",
+    "2.5 PTS_error", "2.6 CAT_error"
+};
+
+unsigned int crc32_table[256];
+
+void crc32_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i << 24;
+        for (int k = 0; k < 8; k++)
+            c = c & 0x80000000 ? (c << 1) ^ 0x04C11DB7 : c << 1;
+        crc32_table[i] = c;
+    }
 }
 
-//=======================================
-// create input and output sockets
+void etr_init(double now)
+{
+    crc32_init();
+    memset(&Etr, 0, sizeof(Etr));
+    memset(Etr.slot, -1, sizeof(Etr.slot));
+    Etr.now = Etr.last_pat = Etr.last_tick = now;
+    Etr.pat_version = -1;
+}
 
-int create_sockets(void)
+// MPEG-2 CRC32 over a whole section, 0 when it is intact
+unsigned int crc32_mpeg(const unsigned char* p, int len)
 {
-    struct sockaddr_in addr_in;
+    unsigned int crc = 0xFFFFFFFF;
+    while (len-- > 0)
+        crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ *p++];
+    return crc;
+}
 
-    // create what looks like an ordinary UDP socket
-    //
-    fd_in = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_in < 0) {
-        perror("socket");
-        return 1;
+void etr_error(Etr290_t* e, int check, int pid)
+{
+    e->count[check]++;
+    e->last_error[check] = e->now;
+    if (!e->alarm[check]) {
+        e->alarm[check] = 1;
+        printf("\nETR 290 %s raised, PID %d\n", etr_name[check], pid);
     }
+}
 
-    // allow multiple sockets to use the same PORT number
-    //
-    unsigned int yes = 1;
-    if (
-        setsockopt(
-            fd_in, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)
-        ) < 0
-        ) {
-        perror("Reusing ADDR failed");
-        return 1;
+EtrPid_t* etr_pid(Etr290_t* e, int pid)
+{
+    if (e->slot[pid] == ETR_UNTRACKED)
+        return NULL;
+    if (e->slot[pid] < 0) {
+        if (e->n_pids == ETR_MAX_PIDS) {
+            if (e->n_untracked++ == 0)
+                printf("\nETR 290: more than %d PIDs, PID %d and further ones not monitored\n", ETR_MAX_PIDS, pid);
+            e->slot[pid] = ETR_UNTRACKED;
+            return NULL;
+        }
+        EtrPid_t* p = &e->pids[e->n_pids];
+        memset(p, 0, sizeof(*p));
+        p->pid = pid;
+        p->cc = -1;
+        p->owner = -1;
+        p->pmt_version = -1;
+        p->last_seen = p->last_table = p->last_pts = e->now;
+        e->slot[pid] = e->n_pids++;
     }
+    return &e->pids[e->slot[pid]];
+}
 
-    // set up receive address
-    //
-    memset(&addr_in, 0, sizeof(addr_in));
-    addr_in.sin_family = AF_INET;
-    if (InputInterface == NULL)
-        addr_in.sin_addr.s_addr = htonl(INADDR_ANY); // differs from sender
-    else
-#ifdef _WIN32
-        inet_pton(AF_INET, InputInterface, &addr_in.sin_addr.s_addr);
-#else
-        addr_in.sin_addr.s_addr = inet_addr(InputInterface);
-#endif
-    addr_in.sin_port = htons(InputPort);
+void etr_sync_error(Etr290_t* e)
+{
+    e->good_sync = 0;
+    etr_error(e, ETR_SYNC_BYTE, -1);
+    if (++e->bad_sync >= 2 && !e->sync_lost) {
+        e->sync_lost = 1;
+        etr_error(e, ETR_SYNC_LOSS, -1);
+    }
+    e->pos++;
+}
 
-    // bind to receive address
-    //
-    if (bind(fd_in, (struct sockaddr*) & addr_in, sizeof(addr_in)) < 0) {
-        perror("bind");
-        return 1;
+// the ES and PCR PIDs of a PMT are no longer listed by it
+void etr_unreference(Etr290_t* e, int pmt_pid)
+{
+    for (int i = 0; i < e->n_pids; i++) {
+        EtrPid_t* q = &e->pids[i];
+        if (q->owner != pmt_pid)
+            continue;
+        q->owner = -1;
+        q->is_pcr = 0;
+        if (!q->is_pmt)
+            q->referenced = 0;
     }
+}
 
-    // use setsockopt() to request that the kernel join a multicast group
-    //
-    struct ip_mreq mreq;
-#ifdef _WIN32
-    inet_pton(AF_INET, InputMCast, &mreq.imr_multiaddr.s_addr);
-#else
-    mreq.imr_multiaddr.s_addr = inet_addr(InputMCast);
-#endif
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+// PAT, CAT or PMT section starting in this packet
+void etr_section(Etr290_t* e, EtrPid_t* p, unsigned char* ts, int start)
+{
+    int s = start + 1 + ts[start];      // skip pointer_field
+    if (s + 3 > TS_LEN)
+        return;
+    int table_id = ts[s];
+    int len = 3 + (((ts[s + 1] & 0x0F) << 8) | ts[s + 2]);
+    if (p->pid == 0 && table_id != 0x00)
+        etr_error(e, ETR_PAT, 0);
+    if (p->pid == 1 && table_id != 0x01)
+        etr_error(e, ETR_CAT, 1);
+    if (p->pid == 0 && table_id == 0x00)
+        e->last_pat = e->now;
+    if (p->pid == 1 && table_id == 0x01)
+        e->cat_seen = 1;
+    if (p->is_pmt && table_id == 0x02)
+        p->last_table = e->now;
+    if (s + len > TS_LEN || len < 12)
+        return;                         // continues in the next packets
+    if (crc32_mpeg(ts + s, len) != 0) {
+        etr_error(e, ETR_CRC, p->pid);
+        return;
+    }
 
-    if (
-        setsockopt(
-            fd_in, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)
-        ) < 0
-        ) {
-        perror("setsockopt");
-        return 1;
+    if (p->pid == 0 && table_id == 0x00 && (ts[s + 5] & 0x01)) {
+        // a new PAT version replaces the PMT PIDs of the previous one
+        int version = (ts[s + 5] >> 1) & 0x1F;
+        int changed = version != e->pat_version;
+        if (changed) {
+            for (int i = 0; i < e->n_pids; i++)
+                if (e->pids[i].is_pmt)
+                    e->pids[i].is_pmt = e->pids[i].referenced = 0;
+            e->pat_version = version;
+        }
+        for (int i = s + 8; i + 4 <= s + len - 4; i += 4) {
+            int program = (ts[i] << 8) | ts[i + 1];
+            EtrPid_t* pmt = program ? etr_pid(e, ((ts[i + 2] & 0x1F) << 8) | ts[i + 3]) : NULL;
+            if (pmt != NULL)
+                pmt->is_pmt = pmt->referenced = 1;
+        }
+        // PMTs gone with the old version take their ES and PCR PIDs along
+        for (int i = 0; changed && i < e->n_pids; i++) {
+            if (e->pids[i].pmt_version >= 0 && !e->pids[i].is_pmt) {
+                etr_unreference(e, e->pids[i].pid);
+                e->pids[i].pmt_version = -1;
+            }
+        }
+    }
+    else if (p->is_pmt && table_id == 0x02 && (ts[s + 5] & 0x01)) {
+        // a new PMT version replaces the ES and PCR PIDs of the previous
+        // one; PIDs listed by several PMTs are taken back by the others
+        // on their next section
+        int version = (ts[s + 5] >> 1) & 0x1F;
+        if (version != p->pmt_version) {
+            etr_unreference(e, p->pid);
+            p->pmt_version = version;
+        }
+        EtrPid_t* pcr = etr_pid(e, ((ts[s + 8] & 0x1F) << 8) | ts[s + 9]);
+        if (pcr != NULL && pcr->pid != PID_NULL) {
+            pcr->is_pcr = 1;
+            pcr->owner = p->pid;
+        }
+        int i = s + 12 + (((ts[s + 10] & 0x0F) << 8) | ts[s + 11]);
+        for (; i + 5 <= s + len - 4; i += 5 + (((ts[i + 3] & 0x0F) << 8) | ts[i + 4])) {
+            EtrPid_t* es = etr_pid(e, ((ts[i + 1] & 0x1F) << 8) | ts[i + 2]);
+            if (es != NULL) {
+                es->referenced = 1;
+                es->owner = p->pid;
+            }
+        }
     }
+}
 
-    //---------------------------
-    // Output socket
+void etr_packet(Etr290_t* e, unsigned char* ts)
+{
+    TSHDR_t* h = (TSHDR_t*)ts;
+    unsigned long long int pos = e->pos++;
+    e->bad_sync = 0;
+    if (e->sync_lost && ++e->good_sync >= 5)
+        e->sync_lost = 0;
 
-    // create what looks like an ordinary UDP socket
-    //
-    fd_out = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_out < 0) {
-        perror("socket");
-        return 1;
-    }
+    int pid = get_pid(h);
+    if (h->tei)
+        etr_error(e, ETR_TRANSPORT, pid);
+    if (pid == PID_NULL)
+        return;
+    EtrPid_t* p = etr_pid(e, pid);
+    if (p == NULL)
+        return;
+    p->last_seen = e->now;
 
-    // set up interface address
-    //
-    if (OutputInterface != NULL)
-    {
-        memset(&addr_in, 0, sizeof(addr_in));
-        addr_in.sin_family = AF_INET;
-    #ifdef _WIN32
-            inet_pton(AF_INET, InputInterface, &addr_in.sin_addr.s_addr);
-    #else
-            addr_in.sin_addr.s_addr = inet_addr(InputInterface);
-    #endif
-        addr_in.sin_port = htons(InputPort);
+    int has_af = h->afc & 2;
+    int has_payload = h->afc & 1;
+    int discontinuity = has_af && ts[4] > 0 && (ts[5] & 0x80);
+    int start = 4 + (has_af ? 1 + ts[4] : 0);
 
-        // bind to receive address
-        //
-        if (bind(fd_out, (struct sockaddr*) & addr_in, sizeof(addr_in)) < 0) {
-            perror("bind");
-            return 1;
+    // 1.4: +1 per payload packet, one repeat allowed, no change without payload
+    if (p->cc >= 0 && !discontinuity) {
+        if (h->cc == p->cc) {
+            if (has_payload && ++p->cc_repeat > 1)
+                etr_error(e, ETR_CC, pid);
         }
+        else if (!has_payload || h->cc != ((p->cc + 1) & 0x0F))
+            etr_error(e, ETR_CC, pid);
+        if (h->cc != p->cc)
+            p->cc_repeat = 0;
     }
+    p->cc = h->cc;
 
-    // set up destination address
-    //
-    memset(&addr_out, 0, sizeof(addr_out));
-    addr_out.sin_family = AF_INET;
-    inet_pton(AF_INET, OutputMCast, &addr_out.sin_addr.s_addr);
-    addr_out.sin_port = htons(OutputPort);
+    if (h->tfc) {
+        if (pid == 0)
+            etr_error(e, ETR_PAT, pid);
+        else if (p->is_pmt)
+            etr_error(e, ETR_PMT, pid);
+        else
+            e->scrambled = 1;
+    }
+    else if (h->pusi && has_payload && start < TS_LEN) {
+        if (pid == 0 || pid == 1 || p->is_pmt)
+            etr_section(e, p, ts, start);
+        else if (start + 14 <= TS_LEN && ts[start] == 0 && ts[start + 1] == 0 && ts[start + 2] == 1
+            && (ts[start + 7] & 0x80)) {
+            // PES header with a PTS
+            if (p->has_pts && e->now - p->last_pts > 0.7)
+                etr_error(e, ETR_PTS, pid);
+            p->has_pts = 1;
+            p->last_pts = e->now;
+        }
+    }
 
-    return 0;
+    unsigned long long int pcr;
+    if (get_pcr(ts, &pcr)) {
+        if (p->pcr_pos > 0 && !discontinuity) {
+            unsigned long long int delta = (pcr + PCR_WRAP - p->pcr) % PCR_WRAP;
+            if (delta > ETR_PCR_DISC_MAX)
+                etr_error(e, ETR_PCR_DISC, pid);
+            else {
+                if (delta > ETR_PCR_REP_MAX)
+                    etr_error(e, ETR_PCR_REP, pid);
+                // constant rate: the previous interval predicts this PCR
+                unsigned long long int packets = pos - p->pcr_pos;
+                if (p->pcr_ticks_per_packet > 0) {
+                    double err = (double)delta - packets * p->pcr_ticks_per_packet;
+                    if (err > ETR_PCR_ACC_MAX || err < -ETR_PCR_ACC_MAX)
+                        etr_error(e, ETR_PCR_ACC, pid);
+                }
+                p->pcr_ticks_per_packet = packets ? (double)delta / packets : 0;
+            }
+        }
+        else
+            p->pcr_ticks_per_packet = 0;
+        p->pcr = pcr;
+        p->pcr_pos = pos + 1;   // + 1 so that 0 means no PCR yet
+    }
 }
 
-void parse_args(int argc, char** argv)
+// timeouts and alarm clearing
+void etr_tick(Etr290_t* e)
 {
-    if (argc < 5)
-    {
-        printf("usage  : %s mcast_in port_in mcast_out port_out pid1 [pid2 ...]\n", argv[0]);
-        printf("example: %s 239.1.2.3 5000 239.3.2.1 6000 100 110 120\n", argv[0]);
-        exit(1);
+    if (e->now - e->last_tick < 0.1)
+        return;
+    e->last_tick = e->now;
+
+    if (e->now - e->last_pat > 0.5) {
+        etr_error(e, ETR_PAT, 0);
+        e->last_pat = e->now;
+    }
+    for (int i = 0; i < e->n_pids; i++) {
+        EtrPid_t* p = &e->pids[i];
+        if (p->is_pmt && e->now - p->last_table > 0.5) {
+            etr_error(e, ETR_PMT, p->pid);
+            p->last_table = e->now;
+        }
+        if (p->referenced && e->now - p->last_seen > ETR_PID_TIMEOUT) {
+            etr_error(e, ETR_PID, p->pid);
+            p->last_seen = e->now;
+        }
+        if (p->has_pts && e->now - p->last_pts > 0.7) {
+            etr_error(e, ETR_PTS, p->pid);
+            p->last_pts = e->now;
+        }
     }
+    if (e->scrambled && !e->cat_seen)
+        etr_error(e, ETR_CAT, 1);
+    e->scrambled = 0;
 
-    int arg = 1;
-    InputMCast = argv[arg++]; 
-    InputPort = atoi(argv[arg++]);
-    OutputMCast = argv[arg++];
-    OutputPort = atoi(argv[arg++]);
-    for (; arg < argc; )
-        Pid2Patch[Pid2PatchCount++] = atoi(argv[arg++]);
+    for (int check = 0; check < ETR_COUNT; check++) {
+        if (e->alarm[check] && e->now - e->last_error[check] > ETR_ALARM_HOLD) {
+            e->alarm[check] = 0;
+            printf("\nETR 290 %s cleared\n", etr_name[check]);
+        }
+    }
 }
 
-
-int main( int argc, char **argv)
+void etr_print(Etr290_t* e)
 {
-    printf("tspidfilter\n");
+    printf("\n  ETR 290: %d PIDs tracked", e->n_pids);
+    if (e->n_untracked > 0)
+        printf(", %d not monitored (table full)", e->n_untracked);
+    for (int check = 0; check < ETR_COUNT; check++)
+        if (e->count[check])
+            printf("\n  %-40s %10llu%s", etr_name[check], e->count[check], e->alarm[check] ? "  ALARM" : "");
+    printf("\n");
+}
 
-    parse_args(argc, argv);
+//=======================================
+// SFN MIP verification (-M, live mode)
+//
+// A DVB-T SFN adapter inserts one megaframe initialization packet
+// (MIP, PID 0x15, ETSI TS 101 191) per megaframe. Its pointer gives the
+// number of packets from the MIP to the start of the next megaframe and
+// its STS the time of that start after the last 1 pps pulse, in 100 ns
+// units. Transmitters rely on both, so the filter must not move a
+// single packet. mip_check() counts packets and, on each MIP, checks
+// its CRC, that the megaframe starts it announces are evenly spaced
+// (megaframe size learned from the first two MIPs), that no megaframe
+// went by without MIP, that STS advances by a constant step and that
+// TPS does not change. It runs on the input before the patch and on
+// the output after it: any difference comes from the filter. The cost
+// is one PID compare per packet.
 
-    printf("Input : %s : %u from %s\n", InputMCast, InputPort, InputInterface ? InputInterface : "any");
-    printf("Output: %s : %u from %s\n", OutputMCast, OutputPort, OutputInterface ? OutputInterface : "any");
-    printf("PIDs  : ");
-    for (int i = 0; i < Pid2PatchCount; )
-    {
-        printf("%u", Pid2Patch[i++]);
-        if (i < Pid2PatchCount)
-            printf(", ");
-    }
-    printf("\n");
+#define MIP_PID         0x15
+#define STS_WRAP        10000000    // 1 s in 100 ns units
 
-    if (sizeof(TSHDR_t) != 4)
-    {
-        printf("TSHDR_t size error : %ld\n", sizeof(TSHDR_t));
-        exit(1);
-    }
+#define MIP_CRC         0
+#define MIP_POINTER     1
+#define MIP_MISSING     2
+#define MIP_STS         3
+#define MIP_TPS         4
+#define MIP_COUNT       5
 
-#ifdef _WIN32
-    //
-    // Initialize Windows Socket API with given VERSION.
-    //
-    WSADATA wsaData;
-    if (WSAStartup(0x0101, &wsaData)) {
-        perror("WSAStartup");
-        return 1;
+typedef struct {
+    const char* name;
+    unsigned long long int pos;         // packets seen
+    unsigned long long int count_mip;
+    unsigned long long int next_start;  // next megaframe start, 0 before the first MIP
+    unsigned long long int megaframe;   // packets per megaframe, 0 until known
+    unsigned int sts;
+    unsigned int sts_step;              // 0 until known, STS_WRAP when it is 0
+    unsigned int tps;
+    unsigned long long int count[MIP_COUNT];
+} Mip_t;
+
+Mip_t MipIn = { "input", 0, 0, 0, 0, 0, 0, 0, { 0 } };
+Mip_t MipOut = { "output", 0, 0, 0, 0, 0, 0, 0, { 0 } };
+
+const char* mip_name[MIP_COUNT] = { "CRC", "pointer", "missing MIP", "STS", "TPS change" };
+
+void mip_error(Mip_t* m, int check, unsigned long long int value, unsigned long long int expected)
+{
+    m->count[check]++;
+    printf("\nMIP %s: %s error at packet %llu, %llu instead of %llu\n", m->name, mip_name[check], m->pos,
+        value, expected);
+}
+
+void mip_packet(Mip_t* m, unsigned char* ts)
+{
+    TSHDR_t* h = (TSHDR_t*)ts;
+    int p = 4 + (h->afc & 2 ? 1 + ts[4] : 0);
+    if (!(h->afc & 1) || p + 20 > TS_LEN || ts[p] != 0x00)     // synchronization_id 0: DVB-T
+        return;
+    int len = 2 + ts[p + 1];
+    if (p + len > TS_LEN || len < 19 || crc32_mpeg(ts + p, len) != 0) {
+        mip_error(m, MIP_CRC, 0, 0);
+        return;
     }
-#endif
+    m->count_mip++;
+    unsigned int pointer = (ts[p + 2] << 8) | ts[p + 3];
+    unsigned int sts = (ts[p + 6] << 16) | (ts[p + 7] << 8) | ts[p + 8];
+    unsigned int tps = (ts[p + 12] << 24) | (ts[p + 13] << 16) | (ts[p + 14] << 8) | ts[p + 15];
+    unsigned long long int start = m->pos + 1 + pointer;
 
-    if (create_sockets())
-    {
-        printf("error create_sockets\n");
-        return 1;
+    if (sts >= STS_WRAP)
+        mip_error(m, MIP_STS, sts, STS_WRAP - 1);
+    if (m->next_start > 0) {
+        unsigned long long int distance = start > m->next_start ? start - m->next_start : 0;
+        if (m->megaframe == 0)
+            m->megaframe = distance;
+        else if (distance > m->megaframe && distance % m->megaframe == 0)
+            mip_error(m, MIP_MISSING, distance / m->megaframe - 1, 0);
+        else if (distance != m->megaframe)
+            mip_error(m, MIP_POINTER, distance, m->megaframe);
+
+        unsigned int step = (sts + STS_WRAP - m->sts) % STS_WRAP;
+        if (m->sts_step == 0)
+            m->sts_step = step ? step : STS_WRAP;
+        else if (distance == m->megaframe && (step ? step : STS_WRAP) != m->sts_step)
+            mip_error(m, MIP_STS, step, m->sts_step);
+        if (tps != m->tps)
+            mip_error(m, MIP_TPS, tps, m->tps);
     }
+    m->next_start = start;
+    m->sts = sts;
+    m->tps = tps;
+}
 
-    //------------------------
-    // processing loop
-    unsigned long long int count_udp = 0;
-    unsigned long long int count_ts = 0;
-    unsigned long long int count_patched = 0;
-    struct sockaddr_in addr_in;
-    time_t last_display = 0;
+void mip_check(Mip_t* m, unsigned char* ts_buf, int n_ts)
+{
+    for (; n_ts > 0; n_ts--, ts_buf += TS_LEN, m->pos++)
+        if (get_pid((TSHDR_t*)ts_buf) == MIP_PID && check_sync((TSHDR_t*)ts_buf))
+            mip_packet(m, ts_buf);
+}
 
-    while (1) {
-        //------------------------
-        // get UDP in
+void mip_print(Mip_t* m)
+{
+    printf("\n  MIP %-6s %8llu MIPs, megaframe %6llu packets, STS step %7u, errors:", m->name, m->count_mip,
+        m->megaframe, m->sts_step);
+    for (int check = 0; check < MIP_COUNT; check++)
+        printf(" %llu %s%s", m->count[check], mip_name[check], check < MIP_COUNT - 1 ? "," : "\n");
+}
 
-        int addrlen = sizeof(addr_in);
-        int n_in = recvfrom(
-            fd_in,
-            (char*)msgbuf,
-            MSGBUFSIZE,
-            0,
-            (struct sockaddr*) & addr_in,
-            (socklen_t*)&addrlen
-        );
-        if (n_in < 0) {
-            perror("recvfrom");
-            continue;
-        }
+//=======================================
+// Per-PID fingerprints (-F, live mode)
+//
+// fp_input() hashes each packet (CRC-32C, SSE 4.2 when the CPU has it)
+// as received, before the T2-MI and PES stages may rewrite it, and
+// patch_ts() once patched; an untouched packet is hashed once for both
+// unless one of those stages is on. Per PID and side the packet hashes
+// are chained into a chunk hash. A chunk ends after a packet whose hash
+// has its low FpBits bits at zero, so chunk boundaries depend only on
+// content: two instances, or input and output, cut the same chunks
+// wherever they started, and comparing the exported lines shows visible
+// PIDs passing bit-exact and hidden ones missing on the output side.
+// Content repeating with a short period (PSI, CC aside) may never hit
+// the condition; such chunks are also cut every 16 << FpBits packets,
+// which only lines up between instances that started on the same
+// packet. Null packets are skipped.
+// Each chunk is a line of the -F file: time, side, PID, packets, hash.
 
-        //------------------------
-        // compute length, number of TS packets, offset (UDP or RTP)
+#define FP_MAX_PIDS     256
 
-        int n_ts = n_in / TS_LEN;
-        int ts_length = n_ts * TS_LEN;
-        int ts_offset = n_in - ts_length;
+typedef struct {
+    unsigned int hash;
+    unsigned int count;
+} FpChunk_t;
 
-        //------------------------
-        // Patch PIDs
+typedef struct {
+    FILE* f;
+    unsigned int mask;
+    short slot[PID_COUNT];      // index in chunk, -1 if untracked
+    int n_pids;
+    FpChunk_t chunk[FP_MAX_PIDS][2];    // [slot][0 input, 1 output]
+    unsigned long long int count_chunks;
+    unsigned int in_hash[MSGBUFSIZE / TS_LEN];  // of the datagram being patched
+    int rehash;                 // a stage rewrites payloads (-T, -X)
+} Fingerprint_t;
 
-        count_patched += patch_ts(msgbuf + ts_offset, n_ts);
-        ++count_udp;
-        count_ts += n_ts;
+Fingerprint_t Fp;
 
-        time_t now;
-        if (time(&now) - last_display >= 5)
-        {
-            printf("%8I64u UDP (%d bytes), %8I64u TS, %8I64u patched\r", count_udp, n_in, count_ts, count_patched);
-            last_display = now;
-        }
+unsigned int crc32c_table[256];
 
-        //------------------------
-        // send patched UDP
+unsigned int crc32c_soft(unsigned int crc, const unsigned char* p, int len)
+{
+    crc = ~crc;
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
 
-        int n_out = sendto(
-            fd_out,
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char* p, int len)
+{
+    unsigned long long int c = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned long long int v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    unsigned int c32 = (unsigned int)c;
+    for (; len > 0; len--)
+        c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+#endif
+
+unsigned int (*crc32c)(unsigned int crc, const unsigned char* p, int len) = crc32c_soft;
+
+int fp_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32c_sse42;
+#endif
+    Fp.f = fopen(FpFile, "a");
+    if (Fp.f == NULL) {
+        perror(FpFile);
+        return 1;
+    }
+    Fp.mask = (1u << FpBits) - 1;
+    Fp.rehash = T2miPid >= 0 || PesSpecCount > 0;
+    memset(Fp.slot, -1, sizeof(Fp.slot));
+    printf("Finger: %s, about %u packets per chunk, CRC-32C%s\n", FpFile, Fp.mask + 1,
+        crc32c == crc32c_soft ? "" : " SSE 4.2");
+    return 0;
+}
+
+void fp_add(Fingerprint_t* fp, int side, unsigned int pid, unsigned int hash)
+{
+    if (pid == PID_NULL)
+        return;
+    if (fp->slot[pid] < 0) {
+        if (fp->n_pids == FP_MAX_PIDS)
+            return;
+        fp->slot[pid] = fp->n_pids++;
+    }
+    FpChunk_t* c = &fp->chunk[fp->slot[pid]][side];
+    c->hash = crc32c(c->hash, (const unsigned char*)&hash, sizeof(hash));
+    c->count++;
+    if ((hash & fp->mask) == 0 || c->count >= (fp->mask + 1) << 4) {
+        fprintf(fp->f, "%lld %s %4u %6u %08x\n", (long long int)time(NULL), side ? "out" : "in", pid, c->count, c->hash);
+        c->hash = 0;
+        c->count = 0;
+        fp->count_chunks++;
+    }
+}
+
+// input side of a datagram, hashed before any stage rewrites it
+void fp_input(Fingerprint_t* fp, unsigned char* ts_buf, int n_ts)
+{
+    for (int i = 0; i < n_ts; i++, ts_buf += TS_LEN) {
+        if (!check_sync((TSHDR_t*)ts_buf))
+            continue;
+        fp->in_hash[i] = crc32c(0, ts_buf, TS_LEN);
+        fp_add(fp, 0, get_pid((TSHDR_t*)ts_buf), fp->in_hash[i]);
+    }
+}
+
+// with fp, fp_input() must have seen the datagram first
+int patch_ts(unsigned char* ts_buf, int n_ts, const unsigned short* pids, int n_pids, PidStats_t* pid_stats,
+    Etr290_t* etr, Fingerprint_t* fp)
+{
+    int n_patched = 0;
+
+    for (int k = 0; k < n_ts; k++, ts_buf += TS_LEN)
+    {
+        if (!check_sync((TSHDR_t*)ts_buf))
+        {
+            printf("sync error !\n");
+            if (pid_stats)
+                ++pid_stats->count_sync_err;
+            if (etr)
+                etr_sync_error(etr);
+            continue;
+        }
+        if (pid_stats)
+            ++pid_stats->count_pid[get_pid((TSHDR_t*)ts_buf)];
+        if (etr)
+            etr_packet(etr, ts_buf);
+
+        unsigned int pid_in = get_pid((TSHDR_t*)ts_buf);
+
+        for (int i = 0; i < n_pids; i++)
+        {
+            if (get_pid((TSHDR_t*)ts_buf) == pids[i])
+            {
+                set_pid((TSHDR_t*)ts_buf, PID_NULL);
+                ++n_patched;
+                //break;
+            }
+        }
+
+        if (fp) {
+            unsigned int hash = fp->rehash || get_pid((TSHDR_t*)ts_buf) != pid_in
+                ? crc32c(0, ts_buf, TS_LEN) : fp->in_hash[k];
+            fp_add(fp, 1, get_pid((TSHDR_t*)ts_buf), hash);
+        }
+    }
+
+    return n_patched;
+}
+
+//=======================================
+// T2-MI aware filtering (-T, live mode)
+//
+// DVB-T2 feeds carry their services inside T2-MI (ETSI TS 102 773) on
+// one PID of the outer TS. t2mi_patch() follows the T2-MI packets of
+// that PID byte by byte, and the BB-frames they carry (EN 302 755) per
+// PLP, to find the inner TS packets and hide the Pid2Patch PIDs there
+// as patch_ts() does outside. Nothing is moved: T2-MI packets keep
+// their size, timestamps and L1 packets are untouched, only the inner
+// PID bytes and the checksums covering them change:
+// - the T2-MI packet CRC-32, updated with the CRC of the changes (CRC
+//   is linear), clocked one byte late so that the first PID byte can
+//   still be amended when the second one decides
+// - in normal mode (NM), the CRC-8 of the inner packet, carried in
+//   place of the sync byte of the next one, fixed the same way
+// High efficiency mode (HEM, no sync byte nor CRC-8), ISSY fields (NM)
+// and deleted null packet counters (NPD) are skipped over, deleted null
+// packets are not reinserted. An inner packet whose two PID bytes fall
+// in different T2-MI packets can only be patched while the first CRC-32
+// is still in the same datagram, else it is counted as missed. Errors
+// (outer CC, BB header CRC) resync on the next T2-MI packet start.
+
+#define T2MI_BBFRAME    0x00
+#define T2MI_STUFFING   0xFF    // not a packet type, padding up to the next TS packet
+
+typedef struct {
+    int up_pos;                 // byte index in the current user packet, -1 until SYNCD
+    int up_len;                 // with ISSY and DNP, 0 until ISSY is seen
+    unsigned char pid_hi;       // first PID byte, waiting for the second one
+    unsigned char* pid_hi_at;
+    unsigned long long int pid_hi_packet;   // T2-MI packet it belongs to
+    int pid_hi_after;           // T2-MI payload bytes after it in that packet
+    unsigned long long int pid_hi_dgram;
+    unsigned char crc8_delta;   // NM: CRC-8 change for the next sync byte slot
+} T2miPlp_t;
+
+typedef struct {
+    int pid;                    // outer PID carrying T2-MI
+    int plp;                    // PLP to filter, -1 for all
+    int cc;
+    int synced;                 // at a known position in the T2-MI stream
+    unsigned long long int dgram;   // datagrams seen, for pointers into msgbuf
+
+    // current T2-MI packet
+    unsigned long long int packet;
+    unsigned char hdr[6];
+    int pos;                    // byte index in the packet
+    int payload_len;            // bytes
+    unsigned int crc_delta;     // CRC-32 of the changes so far
+    unsigned char prev_delta;   // change of the previous byte, not clocked yet
+    unsigned char* crc_at[4];   // CRC-32 bytes of the previous packet, this datagram
+    unsigned long long int crc_dgram;
+
+    // current BB-frame
+    unsigned char bbh[10];
+    int plp_id, active;
+    int hem, npd, issyi;
+    int dfl, syncd;             // bytes, syncd -1 if no packet starts in this frame
+
+    T2miPlp_t plps[256];
+
+    unsigned long long int count_packets;
+    unsigned long long int count_bbframes;
+    unsigned long long int count_ts;
+    unsigned long long int count_patched;
+    unsigned long long int count_missed;
+    unsigned long long int count_resync;
+    unsigned long long int count_bbh_err;
+} T2mi_t;
+
+T2mi_t T2mi;
+
+unsigned char crc8_table[256];
+
+unsigned int crc32_clock(unsigned int crc, unsigned char b)
+{
+    return (crc << 8) ^ crc32_table[(crc >> 24) ^ b];
+}
+
+void t2mi_init(void)
+{
+    T2mi.pid = T2miPid;
+    T2mi.plp = T2miPlp;
+    crc32_init();
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 0x80 ? ((c << 1) ^ 0xD5) & 0xFF : (c << 1) & 0xFF;     // x^8+x^7+x^6+x^4+x^2+1
+        crc8_table[i] = (unsigned char)c;
+    }
+    for (int p = 0; p < 256; p++)
+        T2mi.plps[p].up_pos = -1;
+    T2mi.cc = -1;
+    if (T2mi.plp < 0)
+        printf("T2-MI : PID %d, all PLPs\n", T2mi.pid);
+    else
+        printf("T2-MI : PID %d, PLP %d\n", T2mi.pid, T2mi.plp);
+}
+
+void t2mi_resync(T2mi_t* t)
+{
+    t->synced = 0;
+    t->count_resync++;
+    for (int p = 0; p < 256; p++)
+        t->plps[p].up_pos = -1;
+}
+
+// CRC-8 change of an inner packet whose PID bytes changed by d1, d2
+unsigned char crc8_delta(unsigned char d1, unsigned char d2)
+{
+    unsigned char c = crc8_table[d1];
+    c = crc8_table[c ^ d2];
+    for (int i = 3; i < TS_LEN; i++)
+        c = crc8_table[c];
+    return c;
+}
+
+// byte i of the data field of the current BB-frame, in user packet terms
+void t2mi_up_byte(T2mi_t* t, unsigned char* b, int i)
+{
+    T2miPlp_t* p = &t->plps[t->plp_id];
+    if (i == t->syncd) {
+        if (p->up_pos != 0)
+            p->crc8_delta = 0;      // lost track, the pending change is void
+        p->up_pos = 0;
+    }
+    if (p->up_pos < 0)
+        return;
+    if (p->up_pos == 0)
+        p->up_len = TS_LEN - t->hem + t->npd;
+
+    int tsb = p->up_pos + t->hem;   // TS byte index, 0 is the sync byte slot
+    if (tsb == 0)
+        *b ^= p->crc8_delta;        // NM: CRC-8 of the previous packet
+    else if (tsb == 1) {
+        p->crc8_delta = 0;
+        p->pid_hi = *b;
+        p->pid_hi_at = b;
+        p->pid_hi_packet = t->packet;
+        p->pid_hi_after = t->payload_len - (13 + i) - 1;
+        p->pid_hi_dgram = t->dgram;
+    }
+    else if (tsb == 2) {
+        t->count_ts++;
+        unsigned int pid = ((p->pid_hi & 0x1F) << 8) | *b;
+        int hide = 0;
+        for (int k = 0; k < Pid2PatchCount && !hide; k++)
+            hide = pid == Pid2Patch[k];
+        unsigned char d1 = p->pid_hi ^ (p->pid_hi | 0x1F);
+        unsigned char d2 = *b ^ 0xFF;
+        int unsent = p->pid_hi_dgram == t->dgram;   // first byte still in this datagram
+        if (hide && unsent && p->pid_hi_packet == t->packet) {
+            // first byte is the previous one, its change not clocked yet
+            *p->pid_hi_at |= 0x1F;
+            t->prev_delta ^= d1;
+        }
+        else if (hide && unsent && p->pid_hi_packet + 1 == t->packet && t->crc_dgram == t->dgram) {
+            // first byte ended the previous packet, whose CRC is still here
+            unsigned int c = crc32_clock(0, d1);
+            for (int k = 0; k < p->pid_hi_after; k++)
+                c = crc32_clock(c, 0);
+            *p->pid_hi_at |= 0x1F;
+            for (int k = 0; k < 4; k++)
+                *t->crc_at[k] ^= (unsigned char)(c >> (24 - 8 * k));
+        }
+        else if (hide) {
+            t->count_missed++;
+            hide = 0;
+        }
+        if (hide) {
+            *b = 0xFF;
+            t->count_patched++;
+            if (!t->hem)
+                p->crc8_delta = crc8_delta(d1, d2);
+        }
+    }
+    else if (tsb == TS_LEN && !t->hem && t->issyi)
+        p->up_len += (*b & 0xC0) == 0x80 ? 3 : 2;  // NM ISSY: 3 bytes for a long ISCR ('10')
+
+    if (++p->up_pos == p->up_len)
+        p->up_pos = 0;
+}
+
+void t2mi_bbheader(T2mi_t* t)
+{
+    unsigned char c = 0;
+    for (int k = 0; k < 9; k++)
+        c = crc8_table[c ^ t->bbh[k]];
+    int mode = t->bbh[9] ^ c;       // CRC-8 xor MODE: 0 NM, 1 HEM
+    t->count_bbframes++;
+    if (mode > 1) {
+        t->count_bbh_err++;
+        t->plps[t->plp_id].up_pos = -1;
+    }
+    t->active = (t->plp < 0 || t->plp == t->plp_id) && (t->bbh[0] >> 6) == 3 && mode <= 1;   // TS input
+    t->hem = mode;
+    t->issyi = (t->bbh[0] >> 3) & 1;
+    t->npd = (t->bbh[0] >> 2) & 1;
+    t->dfl = ((t->bbh[4] << 8) | t->bbh[5]) / 8;
+    int syncd = (t->bbh[7] << 8) | t->bbh[8];
+    t->syncd = syncd == 0xFFFF ? -1 : syncd / 8;
+}
+
+// byte of the T2-MI stream, may be changed in place
+void t2mi_byte(T2mi_t* t, unsigned char* b)
+{
+    int pos = t->pos++;
+    if (pos == 0 && *b == T2MI_STUFFING) {
+        t->pos = 0;
+        t->synced = 0;          // rest of the TS packet is padding
+        return;
+    }
+
+    int pl = pos - 6;
+    if (pos < 6 || pl < t->payload_len) {
+        unsigned char old = *b;
+        if (pos < 6) {
+            t->hdr[pos] = *b;
+            if (pos == 5)
+                t->payload_len = (((t->hdr[4] << 8) | t->hdr[5]) + 7) / 8;
+        }
+        else if (t->hdr[0] == T2MI_BBFRAME) {
+            if (pl == 1)
+                t->plp_id = *b;
+            else if (pl >= 3 && pl < 13) {
+                t->bbh[pl - 3] = *b;
+                if (pl == 12)
+                    t2mi_bbheader(t);
+            }
+            else if (pl >= 13 && t->active && pl - 13 < t->dfl)
+                t2mi_up_byte(t, b, pl - 13);
+        }
+        // clock the previous byte now that it can no longer change
+        if (t->crc_delta != 0 || t->prev_delta != 0)
+            t->crc_delta = crc32_clock(t->crc_delta, t->prev_delta);
+        t->prev_delta = old ^ *b;
+        return;
+    }
+
+    // CRC-32: flush the last change, then apply the CRC change
+    int k = pl - t->payload_len;
+    if (k == 0 && (t->crc_delta != 0 || t->prev_delta != 0))
+        t->crc_delta = crc32_clock(t->crc_delta, t->prev_delta);
+    t->prev_delta = 0;
+    *b ^= (unsigned char)(t->crc_delta >> (24 - 8 * k));
+    t->crc_at[k] = b;
+    if (k == 3) {
+        t->crc_dgram = t->dgram;
+        t->crc_delta = 0;
+        t->payload_len = 0;
+        t->pos = 0;
+        t->packet++;
+        t->count_packets++;
+    }
+}
+
+void t2mi_patch(T2mi_t* t, unsigned char* ts_buf, int n_ts)
+{
+    t->dgram++;
+    for (; n_ts > 0; n_ts--, ts_buf += TS_LEN)
+    {
+        TSHDR_t* h = (TSHDR_t*)ts_buf;
+        if (!check_sync(h) || (int)get_pid(h) != t->pid || !(h->afc & 1))
+            continue;
+        if (t->cc >= 0 && h->cc != ((t->cc + 1) & 0x0F) && t->synced)
+            t2mi_resync(t);
+        t->cc = h->cc;
+
+        int p = 4 + (h->afc & 2 ? 1 + ts_buf[4] : 0);
+        if (p >= TS_LEN)
+            continue;
+        int start = TS_LEN;
+        if (h->pusi) {
+            start = p + 1 + ts_buf[p];
+            p++;
+        }
+        for (; p < TS_LEN; p++) {
+            if (p == start) {
+                if (t->synced && t->pos != 0)
+                    t2mi_resync(t);
+                t->synced = 1;
+                t->pos = 0;
+                t->crc_delta = 0;
+                t->prev_delta = 0;
+            }
+            if (t->synced)
+                t2mi_byte(t, ts_buf + p);
+        }
+    }
+}
+
+void t2mi_print(T2mi_t* t)
+{
+    printf("\n  T2-MI %10llu packets %10llu BB-frames %10llu inner TS %8llu patched %6llu missed"
+        " %6llu resync %6llu BB header errors\n", t->count_packets, t->count_bbframes, t->count_ts,
+        t->count_patched, t->count_missed, t->count_resync, t->count_bbh_err);
+}
+
+//=======================================
+// Teletext page and DVB subtitle filtering inside a PID (-X)
+//
+// -X pid:item[,item...] blanks parts of a teletext or DVB subtitle PID
+// instead of hiding it whole. An item is a teletext page (page=888), a
+// subtitle page_id (id=2), or a language (fra) whose subtitle pages are
+// taken from the teletext and subtitling descriptors of the PMT. A
+// streaming PES parser follows the configured PIDs byte by byte across
+// packets: EN 300 472 data units of a hidden page get data_unit_id 0xFF
+// and EN 300 743 segments of a hidden page get segment_type 0xFF, both
+// stuffing that decoders skip, so packet count, PES and segment lengths
+// are unchanged. The byte marked is the first of the unit or segment,
+// the page is known a few bytes later; when it was in a datagram
+// already sent the unit is counted as missed. pes_filter() runs before
+// patch_ts() and only parses packets of the configured PIDs (and, with
+// languages, PAT and PMT sections that fit in one packet), the rest of
+// the traffic only has its PID compared. Pages found through a
+// language are forgotten when the PMT that listed them changes.
+
+#define PES_MAX_SUBS        16      // subtitle page ids per PID
+#define PES_MAX_LANGS       4
+
+#define PES_UNKNOWN         0
+#define PES_TELETEXT        1
+#define PES_SUBTITLE        2
+#define PES_OTHER           3
+
+#define PES_HIDE_CONF       1       // tt_hide: configured page
+#define PES_HIDE_LANG       2       // tt_hide: page of a language
+
+typedef struct {
+    short pid;
+    unsigned char tt_hide[0x800];   // (magazine & 7) << 8 | page, PES_HIDE_*
+    unsigned short sub_hide[PES_MAX_SUBS];
+    int n_sub_hide;
+    int n_sub_conf;                 // configured first, then those of languages
+    char langs[PES_MAX_LANGS][4];
+    int n_langs;
+    int pmt_pid, pmt_version;       // PMT the language pages come from, -1 none
+
+    // parser state
+    signed char cc;
+    int synced;                 // inside a PES whose start was seen
+    int kind;
+    int pos;                    // bytes since the PES start
+    int payload;                // pos of the data_identifier
+    int unit_pos;               // in the data unit or segment
+    int unit_len;
+    unsigned char unit[14];     // first bytes of the unit or segment
+    unsigned char* mark;        // data_unit_id or segment_type
+    unsigned long long int mark_dgram;
+    short tt_page[8];           // page being sent per magazine, -1 none
+    int tt_mag, tt_row;
+
+    unsigned long long int count_units, count_blanked, count_missed;
+} PesFilter_t;
+
+typedef struct {
+    PesFilter_t pids[PES_MAX_PIDS];
+    int n_pids;
+    signed char slot[PID_COUNT];    // index in pids, -1 if not filtered
+    unsigned char is_pmt[PID_COUNT];
+    int pat_version;                // -1 none yet
+    int with_langs;
+    unsigned long long int dgram;
+} PesFilters_t;
+
+PesFilters_t* Pes = NULL;
+
+int pes_init(void)
+{
+    Pes = (PesFilters_t*)calloc(1, sizeof(PesFilters_t));
+    if (Pes == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    crc32_init();
+    memset(Pes->slot, -1, sizeof(Pes->slot));
+    Pes->pat_version = -1;
+    for (int i = 0; i < PesSpecCount; i++)
+    {
+        char* spec = strdup(PesSpec[i]);
+        char* items = spec != NULL ? strchr(spec, ':') : NULL;
+        if (items == NULL) {
+            printf("pages: need pid:item[,item...], not %s\n", PesSpec[i]);
+            free(spec);
+            return 1;
+        }
+        *items++ = 0;
+        PesFilter_t* f = &Pes->pids[Pes->n_pids];
+        f->pid = atoi(spec) & 0x1FFF;
+        f->cc = -1;
+        f->pmt_pid = f->pmt_version = -1;
+        memset(f->tt_page, -1, sizeof(f->tt_page));
+        Pes->slot[f->pid] = (signed char)Pes->n_pids++;
+
+        printf("Pages : PID %d hides", f->pid);
+        for (char* item = strtok(items, ","); item != NULL; item = strtok(NULL, ","))
+        {
+            if (strlen(item) == 3 && item[0] >= 'a' && item[0] <= 'z') {
+                if (f->n_langs < PES_MAX_LANGS)
+                    memcpy(f->langs[f->n_langs++], item, 4);
+                Pes->with_langs = 1;
+                printf(" %s", item);
+                continue;
+            }
+            // the same digits could be a teletext page (hex coded) or a
+            // page_id, so numbers say which
+            char* end = NULL;
+            if (!strncmp(item, "page=", 5)) {
+                long page = strtol(item + 5, &end, 16);
+                if (*end == 0 && page >= 0x100 && page <= 0x8FF) {
+                    f->tt_hide[(page >> 8 & 7) << 8 | (page & 0xFF)] = PES_HIDE_CONF;
+                    printf(" %s", item);
+                    continue;
+                }
+            }
+            else if (!strncmp(item, "id=", 3)) {
+                long id = strtol(item + 3, &end, 10);
+                if (*end == 0 && id >= 0 && id <= 0xFFFF && f->n_sub_hide < PES_MAX_SUBS) {
+                    f->sub_hide[f->n_sub_hide++] = (unsigned short)id;
+                    printf(" %s", item);
+                    continue;
+                }
+            }
+            printf("\npages: %s: need page=100..899 (teletext), id=0..65535 (subtitle, up to %d) or a language\n",
+                item, PES_MAX_SUBS);
+            free(spec);
+            return 1;
+        }
+        f->n_sub_conf = f->n_sub_hide;
+        printf("\n");
+        free(spec);
+    }
+    return 0;
+}
+
+void pes_blank(PesFilter_t* f)
+{
+    if (f->mark_dgram == Pes->dgram) {
+        *f->mark = 0xFF;
+        f->count_blanked++;
+    }
+    else
+        f->count_missed++;
+}
+
+// teletext bytes go LSB first, Hamming 8/4 data bits are 1, 3, 5 and 7
+int pes_unham(unsigned char b)
+{
+    b = (unsigned char)(((b * 0x0802LU & 0x22110LU) | (b * 0x8020LU & 0x88440LU)) * 0x10101LU >> 16);
+    return ((b >> 1) & 1) | ((b >> 2) & 2) | ((b >> 3) & 4) | ((b >> 4) & 8);
+}
+
+// one byte of an EN 300 472 data unit
+void pes_teletext(PesFilter_t* f, unsigned char* b)
+{
+    int i = f->unit_pos++;
+    if (i == 0) {
+        f->mark = b;
+        f->mark_dgram = Pes->dgram;
+    }
+    if (i < (int)sizeof(f->unit))
+        f->unit[i] = *b;
+    if (i == 1)
+        f->unit_len = *b;
+    int is_text = (f->unit[0] == 0x02 || f->unit[0] == 0x03) && f->unit_len == 0x2C;
+
+    if (is_text && i == 5) {
+        int address = pes_unham(f->unit[4]) | pes_unham(f->unit[5]) << 4;
+        f->tt_mag = address & 7;
+        f->tt_row = address >> 3;
+        f->count_units++;
+        // page rows, not the magazine level packets 29 to 31
+        int page = f->tt_page[f->tt_mag];
+        if (f->tt_row != 0 && f->tt_row <= 28 && page >= 0 && f->tt_hide[f->tt_mag << 8 | page])
+            pes_blank(f);
+    }
+    if (is_text && i == 7 && f->tt_row == 0) {
+        int page = pes_unham(f->unit[6]) | pes_unham(f->unit[7]) << 4;
+        f->tt_page[f->tt_mag] = page == 0xFF ? -1 : page;  // 0xFF: time filling
+        if (page != 0xFF && f->tt_hide[f->tt_mag << 8 | page])
+            pes_blank(f);
+    }
+    if (is_text && i == 13 && f->tt_row == 0 && (pes_unham(f->unit[13]) & 1)) {
+        // C11, serial mode: this header ends the pages of all magazines
+        for (int m = 0; m < 8; m++)
+            if (m != f->tt_mag)
+                f->tt_page[m] = -1;
+    }
+    if (i >= 1 && i == 1 + f->unit_len)
+        f->unit_pos = 0;
+}
+
+// one byte of an EN 300 743 segment
+void pes_subtitle(PesFilter_t* f, unsigned char* b)
+{
+    int i = f->unit_pos++;
+    if (i < 0)
+        return;                 // subtitle_stream_id
+    if (i == 0 && *b != 0x0F) {
+        f->synced = 0;          // end_of_PES_data_field_marker
+        return;
+    }
+    if (i == 1) {
+        f->mark = b;
+        f->mark_dgram = Pes->dgram;
+    }
+    if (i < 6)
+        f->unit[i] = *b;
+    if (i == 3) {
+        int page_id = f->unit[2] << 8 | f->unit[3];
+        f->count_units++;
+        for (int k = 0; k < f->n_sub_hide; k++)
+            if (f->sub_hide[k] == page_id)
+                pes_blank(f);
+    }
+    if (i == 5)
+        f->unit_len = f->unit[4] << 8 | f->unit[5];
+    if (i >= 5 && i == 5 + f->unit_len)
+        f->unit_pos = 0;
+}
+
+void pes_byte(PesFilter_t* f, unsigned char* b)
+{
+    int pos = f->pos++;
+    if (pos < 3 && *b != (pos == 2 ? 0x01 : 0x00))
+        f->synced = 0;          // no packet_start_code_prefix
+    else if (pos == 8)
+        f->payload = 9 + *b;
+    else if (pos == f->payload) {
+        f->kind = *b >= 0x10 && *b <= 0x1F ? PES_TELETEXT : *b == 0x20 ? PES_SUBTITLE : PES_OTHER;
+        f->unit_pos = f->kind == PES_SUBTITLE ? -1 : 0;
+    }
+    else if (pos > f->payload && f->kind == PES_TELETEXT)
+        pes_teletext(f, b);
+    else if (pos > f->payload && f->kind == PES_SUBTITLE)
+        pes_subtitle(f, b);
+}
+
+int pes_lang(PesFilter_t* f, const unsigned char* code)
+{
+    for (int i = 0; i < f->n_langs; i++)
+        if (!memcmp(f->langs[i], code, 3))
+            return 1;
+    return 0;
+}
+
+// drop the pages taken from a PMT, keep the configured ones
+void pes_forget(PesFilter_t* f)
+{
+    for (int i = 0; i < (int)sizeof(f->tt_hide); i++)
+        f->tt_hide[i] &= ~PES_HIDE_LANG;
+    f->n_sub_hide = f->n_sub_conf;
+    f->pmt_pid = f->pmt_version = -1;
+}
+
+// PAT or PMT section fitting in this packet: subtitle pages of languages
+void pes_psi(unsigned char* ts, unsigned int pid)
+{
+    TSHDR_t* h = (TSHDR_t*)ts;
+    int s = 4 + (h->afc & 2 ? 1 + ts[4] : 0);
+    if (!h->pusi || !(h->afc & 1) || s >= TS_LEN)
+        return;
+    s += 1 + ts[s];
+    if (s + 12 > TS_LEN)
+        return;
+    int len = 3 + (((ts[s + 1] & 0x0F) << 8) | ts[s + 2]);
+    if (s + len > TS_LEN || len < 12 || crc32_mpeg(ts + s, len) != 0 || !(ts[s + 5] & 1))
+        return;
+    int version = ts[s + 5] >> 1 & 0x1F;
+
+    if (pid == 0 && ts[s] == 0x00) {
+        // a new PAT replaces the PMT PIDs, the pages of dropped PMTs go
+        if (version == Pes->pat_version)
+            return;
+        Pes->pat_version = version;
+        memset(Pes->is_pmt, 0, sizeof(Pes->is_pmt));
+        for (int i = s + 8; i + 4 <= s + len - 4; i += 4)
+            if ((ts[i] << 8 | ts[i + 1]) != 0)
+                Pes->is_pmt[((ts[i + 2] & 0x1F) << 8) | ts[i + 3]] = 1;
+        for (int i = 0; i < Pes->n_pids; i++)
+            if (Pes->pids[i].pmt_pid >= 0 && !Pes->is_pmt[Pes->pids[i].pmt_pid])
+                pes_forget(&Pes->pids[i]);
+        return;
+    }
+    if (ts[s] != 0x02)
+        return;
+    for (int i = 0; i < Pes->n_pids; i++)
+        if (Pes->pids[i].pmt_pid == (int)pid && Pes->pids[i].pmt_version != version)
+            pes_forget(&Pes->pids[i]);
+    int i = s + 12 + (((ts[s + 10] & 0x0F) << 8) | ts[s + 11]);
+    for (; i + 5 <= s + len - 4; i += 5 + (((ts[i + 3] & 0x0F) << 8) | ts[i + 4]))
+    {
+        int slot = Pes->slot[((ts[i + 1] & 0x1F) << 8) | ts[i + 2]];
+        if (slot < 0)
+            continue;
+        PesFilter_t* f = &Pes->pids[slot];
+        if (f->pmt_pid == (int)pid)
+            continue;           // this version is applied already
+        if (f->pmt_pid >= 0)
+            pes_forget(f);      // moved to another program
+        f->pmt_pid = pid;
+        f->pmt_version = version;
+        int end = i + 5 + (((ts[i + 3] & 0x0F) << 8) | ts[i + 4]);
+        for (int d = i + 5; d + 2 <= end && end <= s + len - 4; d += 2 + ts[d + 1])
+        {
+            unsigned char* e = ts + d + 2;
+            int n = ts[d + 1];
+            if (ts[d] == 0x56 || ts[d] == 0x46) {
+                // teletext: subtitle and hearing impaired subtitle pages
+                for (int k = 0; k + 5 <= n; k += 5)
+                    if ((e[k + 3] >> 3 == 2 || e[k + 3] >> 3 == 5) && pes_lang(f, e + k))
+                        f->tt_hide[(e[k + 3] & 7) << 8 | e[k + 4]] |= PES_HIDE_LANG;
+            }
+            else if (ts[d] == 0x59) {
+                // subtitling: composition page, the ancillary one may be shared
+                for (int k = 0; k + 8 <= n; k += 8) {
+                    int page_id = e[k + 4] << 8 | e[k + 5];
+                    int known = 0;
+                    for (int p = 0; p < f->n_sub_hide; p++)
+                        known |= f->sub_hide[p] == page_id;
+                    if (pes_lang(f, e + k) && !known && f->n_sub_hide < PES_MAX_SUBS)
+                        f->sub_hide[f->n_sub_hide++] = (unsigned short)page_id;
+                }
+            }
+        }
+    }
+}
+
+void pes_filter(unsigned char* ts_buf, int n_ts)
+{
+    Pes->dgram++;
+    for (; n_ts > 0; n_ts--, ts_buf += TS_LEN)
+    {
+        TSHDR_t* h = (TSHDR_t*)ts_buf;
+        if (!check_sync(h) || h->tei)
+            continue;
+        unsigned int pid = get_pid(h);
+        if (Pes->with_langs && (pid == 0 || Pes->is_pmt[pid]))
+            pes_psi(ts_buf, pid);
+        int slot = Pes->slot[pid];
+        if (slot < 0 || !(h->afc & 1))
+            continue;
+
+        PesFilter_t* f = &Pes->pids[slot];
+        if (f->cc >= 0 && h->cc != ((f->cc + 1) & 0x0F))
+            f->synced = 0;      // lost bytes, wait for the next PES
+        f->cc = h->cc;
+        int p = 4 + (h->afc & 2 ? 1 + ts_buf[4] : 0);
+        if (h->pusi) {
+            f->synced = 1;
+            f->pos = 0;
+            f->payload = TS_LEN * 1024;
+            f->kind = PES_UNKNOWN;
+        }
+        for (; p < TS_LEN && f->synced && f->kind != PES_OTHER; p++)
+            pes_byte(f, ts_buf + p);
+    }
+}
+
+void pes_print(void)
+{
+    for (int i = 0; i < Pes->n_pids; i++) {
+        PesFilter_t* f = &Pes->pids[i];
+        printf("\n  pages PID %4d %s %10llu units %10llu blanked %6llu missed", f->pid,
+            f->kind == PES_TELETEXT ? "teletext " : f->kind == PES_SUBTITLE ? "subtitles" : "         ",
+            f->count_units, f->count_blanked, f->count_missed);
+    }
+    printf("\n");
+}
+
+//=======================================
+// Worker threads (file mode)
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef LPTHREAD_START_ROUTINE thread_fn_t;
+#define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#else
+typedef pthread_t thread_t;
+typedef void* (*thread_fn_t)(void*);
+#define THREAD_FUNC(name) void* name(void* arg)
+#endif
+
+int thread_start(thread_t* t, thread_fn_t fn, void* arg)
+{
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t == NULL;
+#else
+    return pthread_create(t, NULL, fn, arg);
+#endif
+}
+
+void thread_join(thread_t t)
+{
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+//=======================================
+// Hardware counters per stage (Linux only)
+//
+// One perf_event group (cycles, instructions, cache misses) on the
+// processing thread, read at each stage boundary of one datagram out
+// of PerfEvery. Without -P nothing is opened and the loop only tests
+// fd_perf. Kernel time is included when perf_event_paranoid allows it.
+
+int fd_perf = -1;
+int perf_n_events = 0;
+int perf_task_clock = 0;    // no PMU (VM): cycles replaced by task clock ns
+
+#ifndef _WIN32
+
+int perf_open_event(unsigned int type, unsigned long long int config, int group_fd, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+int perf_open(void)
+{
+    int exclude_kernel = 0;
+    fd_perf = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, exclude_kernel);
+    if (fd_perf < 0) {
+        exclude_kernel = 1;
+        fd_perf = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, exclude_kernel);
+    }
+    if (fd_perf < 0) {
+        perf_task_clock = 1;
+        fd_perf = perf_open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, exclude_kernel);
+    }
+    if (fd_perf < 0) {
+        perror("perf_event_open");
+        return 1;
+    }
+    perf_n_events = 1;
+
+    // missing counters (VMs) just stay at 0
+    if (perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, fd_perf, exclude_kernel) >= 0) {
+        perf_n_events++;
+        if (perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, fd_perf, exclude_kernel) >= 0)
+            perf_n_events++;
+    }
+
+    printf("Perf  : %d counter(s), 1 datagram out of %d%s%s\n",
+        perf_n_events, PerfEvery, exclude_kernel ? ", user space only" : "",
+        perf_task_clock ? ", no PMU: ns instead of cycles" : "");
+    return 0;
+}
+
+void perf_read(unsigned long long int* v)
+{
+    unsigned long long int buf[1 + PERF_COUNT] = { 0 };
+    if (read(fd_perf, buf, sizeof(buf)) < 0)
+        return;
+    for (int i = 0; i < PERF_COUNT; i++)
+        v[i] = buf[1 + i];
+}
+
+#else
+
+int perf_open(void)
+{
+    printf("perf counters not supported\n");
+    return 1;
+}
+
+void perf_read(unsigned long long int* v)
+{
+    memset(v, 0, PERF_COUNT * sizeof(*v));
+}
+
+#endif // _WIN32
+
+// v[i] is the reading at the start of stage i, v[STAGE_COUNT] at the end
+void perf_account(unsigned long long int v[STAGE_COUNT + 1][PERF_COUNT])
+{
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+        for (int i = 0; i < PERF_COUNT; i++)
+            PerfStats.count[stage][i] += v[stage + 1][i] - v[stage][i];
+    ++PerfStats.samples;
+}
+
+void perf_print(void)
+{
+    static const char* stage_name[STAGE_COUNT] = { "receive", "parse", "patch", "send" };
+    unsigned long long int n = PerfStats.samples ? PerfStats.samples : 1;
+    printf("\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+        printf("  %-8s %10llu %s %10llu instructions %8llu cache misses per datagram\n",
+            stage_name[stage],
+            PerfStats.count[stage][PERF_CYCLES] / n,
+            perf_task_clock ? "ns    " : "cycles",
+            PerfStats.count[stage][PERF_INSTRUCTIONS] / n,
+            PerfStats.count[stage][PERF_CACHE_MISSES] / n);
+}
+
+//=======================================
+// TSC cycle accounting
+//
+// Each stage is bracketed by two TSC reads. The receive stage only
+// counts the non-blocking read of a datagram already queued, the wait
+// for it is done beforehand in poll(), so idle waiting never shows up
+// as CPU time.
+
+unsigned long long int read_tsc(void)
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+double wall_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER c, f;
+    QueryPerformanceCounter(&c);
+    QueryPerformanceFrequency(&f);
+    return (double)c.QuadPart / f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+void cycles_start(void)
+{
+    memset(&CycleStats, 0, sizeof(CycleStats));
+    CycleStats.tsc_start = CycleStats.tsc_now = read_tsc();
+    CycleStats.time_start = CycleStats.time_now = wall_time();
+}
+
+// tsc[i] is the TSC at the start of stage i, tsc[STAGE_COUNT] at the end;
+// the receive stage is accounted by the receive loop itself
+void cycles_account(unsigned long long int* tsc)
+{
+    for (int stage = STAGE_PARSE; stage < STAGE_COUNT; stage++) {
+        CycleStats.cycles[stage] += tsc[stage + 1] - tsc[stage];
+        ++CycleStats.count[stage];
+    }
+}
+
+// start of a stage for whichever instrumentation is enabled
+static inline void stage_mark(int stage, int perf_sample,
+    unsigned long long int perf_v[STAGE_COUNT + 1][PERF_COUNT], unsigned long long int* stage_tsc)
+{
+    if (perf_sample)
+        perf_read(perf_v[stage]);
+    if (CycleAccounting)
+        stage_tsc[stage] = read_tsc();
+}
+
+void cycles_print(CycleStats_t* c)
+{
+    static const char* stage_name[STAGE_COUNT] = { "receive", "parse", "patch", "send" };
+    double tsc_hz = c->time_now > c->time_start
+        ? (c->tsc_now - c->tsc_start) / (c->time_now - c->time_start) : 0;
+    double seconds = c->time_now - c->time_start;
+    unsigned long long int total = 0;
+
+    printf("\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        // multi-route mode has no separate parse stage
+        if (c->count[stage] == 0 && c->cycles[stage] == 0)
+            continue;
+        unsigned long long int n = c->count[stage] ? c->count[stage] : 1;
+        total += c->cycles[stage];
+        printf("  %-8s %10llu cycles per datagram, %6.2f %% CPU\n", stage_name[stage],
+            c->cycles[stage] / n,
+            tsc_hz > 0 && seconds > 0 ? 100.0 * c->cycles[stage] / tsc_hz / seconds : 0.0);
+    }
+    printf("  %-8s %10.3f GHz TSC, %6.2f %% CPU\n", "total", tsc_hz / 1e9,
+        tsc_hz > 0 && seconds > 0 ? 100.0 * total / tsc_hz / seconds : 0.0);
+}
+
+//=======================================
+// File mode: parallel patch of a TS capture
+//
+// patch_ts() only looks at the header of each packet and keeps no
+// state between packets, so any 188-byte-aligned split of the file
+// gives exactly the same output as a single sequential pass.
+
+#define FILE_MAX_THREADS    64
+#define FILE_SLICE_TS       (8 * 1024)  // 1.5 MB of TS per worker and block
+
+typedef struct {
+    unsigned char* buf;
+    int n_ts;
+    int n_patched;
+    unsigned long long int cycles;
+} FileSlice_t;
+
+THREAD_FUNC(file_worker)
+{
+    FileSlice_t* slice = (FileSlice_t*)arg;
+    unsigned long long int t0 = CycleAccounting ? read_tsc() : 0;
+    slice->n_patched = patch_ts(slice->buf, slice->n_ts, Pid2Patch, Pid2PatchCount, NULL, NULL, NULL);
+    if (CycleAccounting)
+        slice->cycles = read_tsc() - t0;
+    return 0;
+}
+
+int run_file_mode(void)
+{
+    FILE* fin = fopen(FileIn, "rb");
+    if (fin == NULL) {
+        perror(FileIn);
+        return 1;
+    }
+    FILE* fout = fopen(FileOut, "wb");
+    if (fout == NULL) {
+        perror(FileOut);
+        fclose(fin);
+        return 1;
+    }
+
+    int n_threads = Threads > 0 ? Threads : cpu_count();
+    if (n_threads > FILE_MAX_THREADS)
+        n_threads = FILE_MAX_THREADS;
+    printf("File  : %s -> %s, %d thread(s)\n", FileIn, FileOut, n_threads);
+
+    size_t block_size = (size_t)n_threads * FILE_SLICE_TS * TS_LEN;
+    unsigned char* block = (unsigned char*)malloc(block_size);
+    if (block == NULL) {
+        perror("malloc");
+        fclose(fin);
+        fclose(fout);
+        return 1;
+    }
+
+    unsigned long long int count_ts = 0;
+    unsigned long long int count_patched = 0;
+    unsigned long long int patch_cycles = 0;   // summed over workers
+    FileSlice_t slices[FILE_MAX_THREADS];
+    thread_t threads[FILE_MAX_THREADS];
+    int rc = 0;
+    size_t n_read;
+
+    while ((n_read = fread(block, 1, block_size, fin)) > 0)
+    {
+        // a trailing partial packet is copied through untouched
+        int n_ts = (int)(n_read / TS_LEN);
+        int per_slice = (n_ts + n_threads - 1) / n_threads;
+        int n_slices = 0;
+
+        for (int done = 0; done < n_ts; done += per_slice, n_slices++)
+        {
+            FileSlice_t* slice = &slices[n_slices];
+            slice->buf = block + (size_t)done * TS_LEN;
+            slice->n_ts = n_ts - done < per_slice ? n_ts - done : per_slice;
+            slice->n_patched = 0;
+            slice->cycles = 0;
+        }
+
+        // run slices 1..n on workers, slice 0 on this thread
+        int n_started = 1;
+        for (; n_started < n_slices; n_started++)
+            if (thread_start(&threads[n_started], file_worker, &slices[n_started]))
+                break;
+        if (n_slices > 0)
+            file_worker(&slices[0]);
+        for (int i = n_started; i < n_slices; i++)
+            file_worker(&slices[i]); // thread creation failed, do it here
+        for (int i = 1; i < n_started; i++)
+            thread_join(threads[i]);
+
+        for (int i = 0; i < n_slices; i++) {
+            count_patched += slices[i].n_patched;
+            patch_cycles += slices[i].cycles;
+        }
+        count_ts += n_ts;
+
+        if (fwrite(block, 1, n_read, fout) != n_read) {
+            perror(FileOut);
+            rc = 1;
+            break;
+        }
+    }
+    if (ferror(fin)) {
+        perror(FileIn);
+        rc = 1;
+    }
+
+    printf("%8llu TS, %8llu patched\n", count_ts, count_patched);
+    if (CycleAccounting && count_ts > 0)
+        printf("patch : %.1f cycles per TS, %llu cycles on all threads\n",
+            (double)patch_cycles / count_ts, patch_cycles);
+
+    free(block);
+    fclose(fin);
+    if (fclose(fout) != 0) {
+        perror(FileOut);
+        rc = 1;
+    }
+    return rc;
+}
+
+//=======================================
+// create input and output sockets
+//
+// Groups are IPv4 or IPv6, the family of the socket follows the group.
+// An input group may be given as source@group to join a single source
+// (IGMPv3 / MLDv2 SSM). Interfaces are given by name, index or, for
+// IPv4, one of their addresses.
+
+int addr_parse(Addr_t* addr, const char* host, unsigned short port)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET6, host, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port = htons(port);
+        return 0;
+    }
+    if (inet_pton(AF_INET, host, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port = htons(port);
+        return 0;
+    }
+    printf("%s: not an IPv4 or IPv6 address\n", host);
+    return -1;
+}
+
+socklen_t addr_len(const Addr_t* addr)
+{
+    return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+}
+
+// 0 if the interface does not exist
+unsigned int if_index(const char* iface)
+{
+    if (iface[strspn(iface, "0123456789")] == 0)
+        return atoi(iface);
+    unsigned int index = if_nametoindex(iface);
+#ifndef _WIN32
+    struct in_addr a;
+    struct ifaddrs* list;
+    if (index == 0 && inet_pton(AF_INET, iface, &a) == 1 && getifaddrs(&list) == 0) {
+        for (struct ifaddrs* i = list; i != NULL && index == 0; i = i->ifa_next)
+            if (i->ifa_addr != NULL && i->ifa_addr->sa_family == AF_INET
+                && ((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == a.s_addr)
+                index = if_nametoindex(i->ifa_name);
+        freeifaddrs(list);
+    }
+#endif
+    if (index == 0)
+        printf("%s: no such interface\n", iface);
+    return index;
+}
+
+int create_input_socket(char* mcast, unsigned short port)
+{
+    Addr_t group, source, addr_in;
+    int fd_in;
+
+    // source@group
+    char host[2 * INET6_ADDRSTRLEN + 2];
+    snprintf(host, sizeof(host), "%s", mcast);
+    char* at = strchr(host, '@');
+    if (at != NULL) {
+        *at = 0;
+        if (addr_parse(&source, host, 0))
+            return -1;
+    }
+    if (addr_parse(&group, at != NULL ? at + 1 : host, port))
+        return -1;
+    if (at != NULL && source.sa.sa_family != group.sa.sa_family) {
+        printf("%s: source and group of different families\n", mcast);
+        return -1;
+    }
+    int family = group.sa.sa_family;
+    int level = family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+
+    unsigned int index = 0;
+    if (InputInterface != NULL && (index = if_index(InputInterface)) == 0)
+        return -1;
+
+    // create what looks like an ordinary UDP socket
+    //
+    fd_in = socket(family, SOCK_DGRAM, 0);
+    if (fd_in < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // allow multiple sockets to use the same PORT number
+    //
+    unsigned int yes = 1;
+    if (
+        setsockopt(
+            fd_in, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)
+        ) < 0
+        ) {
+        perror("Reusing ADDR failed");
+        return -1;
+    }
+
+    // set up receive address, any address of the group's family
+    //
+    memset(&addr_in, 0, sizeof(addr_in));
+    addr_in.sa.sa_family = family;
+    if (family == AF_INET6) {
+        addr_in.in6.sin6_addr = in6addr_any;
+        addr_in.in6.sin6_port = htons(port);
+    }
+    else {
+        addr_in.in.sin_addr.s_addr = htonl(INADDR_ANY); // differs from sender
+        addr_in.in.sin_port = htons(port);
+    }
+
+    // bind to receive address
+    //
+    if (bind(fd_in, &addr_in.sa, addr_len(&addr_in)) < 0) {
+        perror("bind");
+        return -1;
+    }
+
+    // use setsockopt() to request that the kernel join a multicast group,
+    // the protocol independent requests cover both families and SSM
+    //
+    int rc;
+    if (at == NULL) {
+        struct group_req req;
+        memset(&req, 0, sizeof(req));
+        req.gr_interface = index;
+        memcpy(&req.gr_group, &group, addr_len(&group));
+        rc = setsockopt(fd_in, level, MCAST_JOIN_GROUP, (char*)&req, sizeof(req));
+    }
+    else {
+        struct group_source_req req;
+        memset(&req, 0, sizeof(req));
+        req.gsr_interface = index;
+        memcpy(&req.gsr_group, &group, addr_len(&group));
+        memcpy(&req.gsr_source, &source, addr_len(&source));
+        rc = setsockopt(fd_in, level, MCAST_JOIN_SOURCE_GROUP, (char*)&req, sizeof(req));
+    }
+    if (rc < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+
+    // Linux delivers every group joined on the host to a socket bound to
+    // the any address, only take ours so several instances can share a port
+    int no = 0;
+#ifdef IP_MULTICAST_ALL
+    if (family == AF_INET)
+        setsockopt(fd_in, IPPROTO_IP, IP_MULTICAST_ALL, (char*)&no, sizeof(no));
+#endif
+#ifdef IPV6_MULTICAST_ALL
+    if (family == AF_INET6)
+        setsockopt(fd_in, IPPROTO_IPV6, IPV6_MULTICAST_ALL, (char*)&no, sizeof(no));
+#endif
+    (void)no;
+
+    return fd_in;
+}
+
+// UDP socket sending to groups of this family through iface, if any
+int create_output_socket(int family, const char* iface)
+{
+    unsigned int index = 0;
+    if (iface != NULL && (index = if_index(iface)) == 0)
+        return -1;
+
+    // create what looks like an ordinary UDP socket
+    //
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (index == 0)
+        return fd;
+
+    // select the interface multicast leaves on
+    //
+    int rc;
+    if (family == AF_INET6)
+        rc = setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, (char*)&index, sizeof(index));
+    else {
+#ifdef _WIN32
+        DWORD req = htonl(index);   // index in network order, as 0.0.0.index
+#else
+        struct ip_mreqn req;
+        memset(&req, 0, sizeof(req));
+        req.imr_ifindex = index;
+#endif
+        rc = setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, (char*)&req, sizeof(req));
+    }
+    if (rc < 0) {
+        perror("IP_MULTICAST_IF");
+        return -1;
+    }
+    return fd;
+}
+
+// Receive timeout of the live input, the shortest any stage asked for
+// to run without input (impairment release, handoff, ETR 290), 0: none
+int InputTimeoutUs = 0;
+
+void input_timeout(int us)
+{
+    if (InputTimeoutUs != 0 && InputTimeoutUs <= us)
+        return;
+    InputTimeoutUs = us;
+#ifdef _WIN32
+    DWORD timeout = (us + 999) / 1000;
+#else
+    struct timeval timeout = { us / 1000000, us % 1000000 };
+#endif
+    setsockopt(fd_in, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+}
+
+int create_sockets(void)
+{
+    fd_in = create_input_socket(InputMCast, InputPort);
+    if (fd_in < 0)
+        return 1;
+
+    //---------------------------
+    // Output socket
+
+    // set up destination address
+    //
+    if (addr_parse(&addr_out, OutputMCast, OutputPort))
+        return 1;
+
+    fd_out = create_output_socket(addr_out.sa.sa_family, OutputInterface);
+    if (fd_out < 0)
+        return 1;
+
+    return 0;
+}
+
+// not handed over on hot restart, they only depend on the command line
+int create_redundant_outputs(void)
+{
+    for (int o = 0; o < OutputCount; o++)
+    {
+        Output_t* out = &Outputs[o];
+        if (addr_parse(&out->addr, out->mcast != NULL ? out->mcast : OutputMCast, OutputPort))
+            return 1;
+        out->fd = create_output_socket(out->addr.sa.sa_family, out->iface);
+        if (out->fd < 0)
+            return 1;
+    }
+    return 0;
+}
+
+//=======================================
+// PID inventory, dry run of the PID list (-A)
+//
+// Reads the input for a time window instead of patching and sending it.
+// PAT and PMT sections are reassembled to list programs and stream
+// types, each PID gets packet, scrambled and PCR counts, and the report
+// shows which PIDs the PID list would hide and the programs that would
+// lose their PMT, PCR or every stream. Captures are read in the same
+// blocks as file mode but parsed sequentially, since sections and PCRs
+// carry state from packet to packet. Bitrates use the wall clock on a
+// live input and the span of the first PCR PID on a capture.
+
+#define INV_MAX_PROGRAMS    64
+#define INV_MAX_STREAMS     32      // per program
+#define INV_SECTION_MAX     1024    // PAT and PMT are at most 1024 bytes
+
+typedef struct {
+    unsigned char type;
+    short pid;
+    const char* what;           // from descriptors, NULL if unknown
+} InvStream_t;
+
+typedef struct {
+    unsigned short number;
+    short pmt_pid;
+    short pcr_pid;              // -1 until the PMT is seen
+    int n_streams;
+    InvStream_t streams[INV_MAX_STREAMS];
+} InvProgram_t;
+
+typedef struct {
+    int active;                 // collecting, started by a pointer_field
+    int len;
+    unsigned char buf[INV_SECTION_MAX];
+} InvSection_t;
+
+typedef struct {
+    unsigned long long int count_pid[PID_COUNT];
+    unsigned long long int count_scrambled[PID_COUNT];
+    unsigned char has_pcr[PID_COUNT];
+    short psi_slot[PID_COUNT];  // index in sec, -1 if not PAT or PMT
+    InvSection_t sec[INV_MAX_PROGRAMS + 1];     // PAT, then one per program
+    InvProgram_t programs[INV_MAX_PROGRAMS];
+    int n_programs;
+    unsigned long long int count_ts, count_udp, count_sync_err, count_crc_err;
+    int clock_pid;              // PCR PID timing a capture, -1 before a PCR
+    unsigned long long int last_pcr;
+    unsigned long long int pcr_span;    // 27 MHz
+    double duration;            // s, set once reading stops
+} Inventory_t;
+
+Inventory_t Inv;
+
+void inv_init(void)
+{
+    crc32_init();
+    memset(&Inv, 0, sizeof(Inv));
+    memset(Inv.psi_slot, -1, sizeof(Inv.psi_slot));
+    Inv.psi_slot[0] = 0;
+    Inv.clock_pid = -1;
+}
+
+const char* inv_type_name(int type)
+{
+    switch (type) {
+    case 0x01: return "MPEG-1 video";
+    case 0x02: return "MPEG-2 video";
+    case 0x03: return "MPEG-1 audio";
+    case 0x04: return "MPEG-2 audio";
+    case 0x05: return "private sections";
+    case 0x06: return "private PES";
+    case 0x0B: case 0x0C: case 0x0D: return "DSM-CC";
+    case 0x0F: return "AAC audio";
+    case 0x10: return "MPEG-4 video";
+    case 0x11: return "LATM AAC audio";
+    case 0x15: return "metadata";
+    case 0x1B: return "H.264 video";
+    case 0x24: return "HEVC video";
+    case 0x81: return "AC-3 audio";
+    case 0x86: return "SCTE-35";
+    case 0x87: return "E-AC-3 audio";
+    default: return "other";
+    }
+}
+
+// what a private PES carries, from its ES_info descriptors
+const char* inv_descriptors(const unsigned char* d, int len)
+{
+    for (int i = 0; i + 2 <= len; i += 2 + d[i + 1]) {
+        switch (d[i]) {
+        case 0x56: return "teletext";
+        case 0x59: return "DVB subtitles";
+        case 0x6A: return "AC-3 audio";
+        case 0x7A: return "E-AC-3 audio";
+        case 0x7B: return "DTS audio";
+        case 0x7C: return "AAC audio";
+        }
+    }
+    return NULL;
+}
+
+InvProgram_t* inv_program(int number)
+{
+    for (int i = 0; i < Inv.n_programs; i++)
+        if (Inv.programs[i].number == number)
+            return &Inv.programs[i];
+    if (Inv.n_programs == INV_MAX_PROGRAMS)
+        return NULL;
+    InvProgram_t* p = &Inv.programs[Inv.n_programs++];
+    memset(p, 0, sizeof(*p));
+    p->number = number;
+    p->pmt_pid = p->pcr_pid = -1;
+    return p;
+}
+
+// a complete PAT or PMT section received on pid, latest version wins
+void inv_section(int pid, const unsigned char* s, int len)
+{
+    if (len < 12 || crc32_mpeg(s, len) != 0) {
+        Inv.count_crc_err++;
+        return;
+    }
+    if (pid == 0 && s[0] == 0x00) {
+        for (int i = 8; i + 4 <= len - 4; i += 4) {
+            int number = (s[i] << 8) | s[i + 1];
+            int pmt_pid = ((s[i + 2] & 0x1F) << 8) | s[i + 3];
+            InvProgram_t* p = number ? inv_program(number) : NULL;
+            if (p == NULL)
+                continue;
+            p->pmt_pid = pmt_pid;
+            if (Inv.psi_slot[pmt_pid] < 0)
+                Inv.psi_slot[pmt_pid] = (short)(1 + (p - Inv.programs));
+        }
+    }
+    else if (pid != 0 && s[0] == 0x02) {
+        InvProgram_t* p = inv_program((s[3] << 8) | s[4]);
+        if (p == NULL)
+            return;
+        p->pcr_pid = ((s[8] & 0x1F) << 8) | s[9];
+        p->n_streams = 0;
+        int i = 12 + (((s[10] & 0x0F) << 8) | s[11]);
+        for (; i + 5 <= len - 4 && p->n_streams < INV_MAX_STREAMS; i += 5 + (((s[i + 3] & 0x0F) << 8) | s[i + 4])) {
+            InvStream_t* es = &p->streams[p->n_streams++];
+            int info_len = ((s[i + 3] & 0x0F) << 8) | s[i + 4];
+            es->type = s[i];
+            es->pid = ((s[i + 1] & 0x1F) << 8) | s[i + 2];
+            es->what = i + 5 + info_len <= len - 4 ? inv_descriptors(s + i + 5, info_len) : NULL;
+        }
+    }
+}
+
+// collect section bytes, the section is handled once complete
+void inv_collect(int pid, InvSection_t* sec, const unsigned char* p, int n)
+{
+    if (!sec->active)
+        return;
+    if (n > INV_SECTION_MAX - sec->len)
+        n = INV_SECTION_MAX - sec->len;
+    memcpy(sec->buf + sec->len, p, n);
+    sec->len += n;
+    if (sec->len < 3)
+        return;
+    int total = 3 + (((sec->buf[1] & 0x0F) << 8) | sec->buf[2]);
+    if (sec->buf[0] == 0xFF || total > INV_SECTION_MAX)
+        sec->active = 0;                // stuffing or broken length
+    else if (sec->len >= total) {
+        inv_section(pid, sec->buf, total);
+        sec->active = 0;
+    }
+}
+
+void inv_packet(unsigned char* ts)
+{
+    TSHDR_t* h = (TSHDR_t*)ts;
+    Inv.count_ts++;
+    if (!check_sync(h)) {
+        Inv.count_sync_err++;
+        return;
+    }
+    unsigned int pid = get_pid(h);
+    Inv.count_pid[pid]++;
+    if (h->tfc)
+        Inv.count_scrambled[pid]++;
+
+    unsigned long long int pcr;
+    if (get_pcr(ts, &pcr)) {
+        Inv.has_pcr[pid] = 1;
+        if (Inv.clock_pid < 0)
+            Inv.clock_pid = pid;
+        else if (Inv.clock_pid == (int)pid) {
+            // a jump of a second or more is a discontinuity, not time
+            unsigned long long int delta = (pcr + PCR_WRAP - Inv.last_pcr) % PCR_WRAP;
+            if (delta < PCR_HZ)
+                Inv.pcr_span += delta;
+        }
+        if (Inv.clock_pid == (int)pid)
+            Inv.last_pcr = pcr;
+    }
+
+    int slot = Inv.psi_slot[pid];
+    if (slot < 0 || !(h->afc & 1) || h->tei)
+        return;
+    int p = 4 + (h->afc & 2 ? 1 + ts[4] : 0);
+    if (p >= TS_LEN)
+        return;
+    InvSection_t* sec = &Inv.sec[slot];
+    if (h->pusi) {
+        int pointer = ts[p++];
+        if (p + pointer >= TS_LEN)
+            return;
+        inv_collect(pid, sec, ts + p, pointer); // end of the previous one
+        sec->active = 1;
+        sec->len = 0;
+        p += pointer;
+    }
+    inv_collect(pid, sec, ts + p, TS_LEN - p);
+}
+
+int inv_hidden(int pid)
+{
+    for (int i = 0; i < Pid2PatchCount; i++)
+        if (Pid2Patch[i] == pid)
+            return 1;
+    return 0;
+}
+
+// what the PID carries, from the tables or the PID value
+void inv_describe(int pid, char* desc, int size)
+{
+    const char* fixed[0x20] = { "PAT", "CAT", "TSDT", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, "NIT", "SDT/BAT", "EIT", "RST", "TDT/TOT", "SFN MIP", NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, "DIT", "SIT" };
+    int n = 0;
+    desc[0] = 0;
+    for (int i = 0; i < Inv.n_programs && n < size; i++) {
+        InvProgram_t* p = &Inv.programs[i];
+        if (p->pmt_pid == pid)
+            n += snprintf(desc + n, size - n, "%sPMT of %u", n ? ", " : "", p->number);
+        for (int k = 0; k < p->n_streams && n < size; k++)
+            if (p->streams[k].pid == pid)
+                n += snprintf(desc + n, size - n, "%s%s 0x%02x of %u", n ? ", " : "",
+                    p->streams[k].what ? p->streams[k].what : inv_type_name(p->streams[k].type),
+                    p->streams[k].type, p->number);
+        if (p->pcr_pid == pid && n < size)
+            n += snprintf(desc + n, size - n, "%sPCR of %u", n ? ", " : "", p->number);
+    }
+    if (n == 0)
+        snprintf(desc, size, "%s", pid == PID_NULL ? "null" : pid < 0x20 && fixed[pid] ? fixed[pid] : "unreferenced");
+}
+
+void inv_print(void)
+{
+    double seconds = Inv.duration;
+    printf("\nInventory: %.1f s, %llu TS, %d program(s), %llu sync errors, %llu CRC errors\n",
+        seconds, Inv.count_ts, Inv.n_programs, Inv.count_sync_err, Inv.count_crc_err);
+
+    for (int i = 0; i < Inv.n_programs; i++) {
+        InvProgram_t* p = &Inv.programs[i];
+        printf("  program %5u  PMT %4d  PCR %4d  %d stream(s)\n", p->number, p->pmt_pid, p->pcr_pid, p->n_streams);
+    }
+
+    printf("\n    PID      packets    Mbit/s  scrambled  PCR  rule  content\n");
+    unsigned long long int kept = 0, hidden = 0;
+    for (int pid = 0; pid < PID_COUNT; pid++) {
+        unsigned long long int n = Inv.count_pid[pid];
+        if (n == 0)
+            continue;
+        char desc[128];
+        inv_describe(pid, desc, sizeof(desc));
+        int hide = inv_hidden(pid);
+        if (hide)
+            hidden += n;
+        else
+            kept += n;
+        char rate[16] = "-";
+        if (seconds > 0)
+            snprintf(rate, sizeof(rate), "%.3f", n * TS_LEN * 8 / seconds / 1e6);
+        printf("  %5d %12llu %9s  %8.1f%%  %3s  %4s  %s\n", pid, n, rate, 100.0 * Inv.count_scrambled[pid] / n,
+            Inv.has_pcr[pid] ? "yes" : "", hide ? "hide" : "", desc);
+    }
+
+    // what the PID list would do to this mux
+    printf("\nPID list: %d PID(s) would hide %llu of %llu packets (%.2f %%)",
+        Pid2PatchCount, hidden, hidden + kept, hidden + kept ? 100.0 * hidden / (hidden + kept) : 0.0);
+    if (seconds > 0)
+        printf(", %.3f Mbit/s", hidden * TS_LEN * 8 / seconds / 1e6);
+    printf("\n");
+    for (int i = 0; i < Pid2PatchCount; i++)
+        if (Inv.count_pid[Pid2Patch[i]] == 0)
+            printf("  warning: PID %u is not in the stream\n", Pid2Patch[i]);
+    for (int i = 0; i < Inv.n_programs; i++) {
+        InvProgram_t* p = &Inv.programs[i];
+        int n_hidden = 0;
+        for (int k = 0; k < p->n_streams; k++)
+            n_hidden += inv_hidden(p->streams[k].pid);
+        if (p->pmt_pid >= 0 && inv_hidden(p->pmt_pid))
+            printf("  warning: program %u loses its PMT (PID %d)\n", p->number, p->pmt_pid);
+        if (p->pcr_pid >= 0 && p->pcr_pid != PID_NULL && inv_hidden(p->pcr_pid))
+            printf("  warning: program %u loses its PCR (PID %d)\n", p->number, p->pcr_pid);
+        if (p->n_streams > 0 && n_hidden == p->n_streams)
+            printf("  warning: program %u loses all its streams\n", p->number);
+    }
+}
+
+int run_inventory(void)
+{
+    inv_init();
+    if (FileIn != NULL)
+    {
+        FILE* fin = fopen(FileIn, "rb");
+        if (fin == NULL) {
+            perror(FileIn);
+            return 1;
+        }
+        printf("Inventory of %s%s\n", FileIn, AnalyzeSeconds > 0 ? ", first seconds only" : "");
+        size_t block_size = (size_t)FILE_SLICE_TS * TS_LEN;
+        unsigned char* block = (unsigned char*)malloc(block_size);
+        if (block == NULL) {
+            perror("malloc");
+            fclose(fin);
+            return 1;
+        }
+        unsigned long long int window = (unsigned long long int)AnalyzeSeconds * PCR_HZ;
+        size_t n_read;
+        int done = 0;
+        while (!done && (n_read = fread(block, 1, block_size, fin)) > 0)
+            for (size_t i = 0; i + TS_LEN <= n_read && !done; i += TS_LEN) {
+                inv_packet(block + i);
+                done = window > 0 && Inv.pcr_span >= window;
+            }
+        if (ferror(fin))
+            perror(FileIn);
+        free(block);
+        fclose(fin);
+        Inv.duration = (double)Inv.pcr_span / PCR_HZ;
+    }
+    else
+    {
+        fd_in = create_input_socket(InputMCast, InputPort);
+        if (fd_in < 0)
+            return 1;
+
+        // wake up every second so a stopped input still ends the window
+#ifdef _WIN32
+        DWORD timeout = 1000;
+#else
+        struct timeval timeout = { 1, 0 };
+#endif
+        setsockopt(fd_in, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        int seconds = AnalyzeSeconds > 0 ? AnalyzeSeconds : 10;
+        printf("Inventory of %s : %u for %d s\n", InputMCast, InputPort, seconds);
+        double start = wall_time();
+        while (wall_time() - start < seconds)
+        {
+            int n_in = recv(fd_in, (char*)msgbuf, MSGBUFSIZE, 0);
+            if (n_in < 0)
+                continue;
+            int n_ts = n_in / TS_LEN;
+            int ts_offset = n_in - n_ts * TS_LEN;
+            for (int i = 0; i < n_ts; i++)
+                inv_packet(msgbuf + ts_offset + i * TS_LEN);
+            Inv.count_udp++;
+        }
+        Inv.duration = wall_time() - start;
+    }
+    inv_print();
+    return 0;
+}
+
+//=======================================
+// Hot restart (Linux only)
+//
+// The running process listens on HandoffPath. A new process started
+// with the same -H path connects to it and receives, over SCM_RIGHTS,
+// the already joined input socket and the output socket along with
+// the counters and the state of the stream stages (see
+// handoff_states()). The old process stops reading, sends out what the
+// impairment stage, the pipeline and the send queues still hold, then
+// hands over, so datagrams arriving during the switch wait in the
+// socket buffer and are picked up by the new process.
+
+#ifndef _WIN32
+
+#define HANDOFF_MAGIC   0x54535048  // "TSPH"
+#define HANDOFF_VERSION 4
+#define HANDOFF_MAX_STATE   (16 * 1024 * 1024)
+
+#define HANDOFF_ETR         0
+#define HANDOFF_MIP_IN      1
+#define HANDOFF_MIP_OUT     2
+#define HANDOFF_T2MI        3
+#define HANDOFF_PES         4
+#define HANDOFF_FP          5
+#define HANDOFF_MONITOR     6
+#define HANDOFF_JITTER      7
+#define HANDOFF_IMPAIR      8
+#define HANDOFF_REORDER     9
+#define HANDOFF_STATES      10
+
+const char* handoff_name[HANDOFF_STATES] = {
+    "ETR 290", "MIP input", "MIP output", "T2-MI", "pages", "fingerprint", "monitor", "PCR jitter",
+    "impair", "reorder"
+};
+
+// state of a stage, sent after the header in HANDOFF_* order
+typedef struct {
+    void* p;
+    unsigned int len;           // 0: stage not running
+    unsigned int key;           // configuration the state is valid for
+} HandoffState_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    Stats_t stats;
+    char input_mcast[ADDR_SPEC_LEN];
+    unsigned short input_port;
+    unsigned int state_len[HANDOFF_STATES];
+    unsigned int state_key[HANDOFF_STATES];
+} Handoff_t;
+
+// received stage states, applied by handoff_apply() once the stages are set up
+HandoffState_t HandoffIn[HANDOFF_STATES];
+
+int fd_handoff_listen = -1;
+volatile int fd_handoff_peer = -1;  // set by listener thread, read by main loop
+
+THREAD_FUNC(handoff_listener)
+{
+    (void)arg;
+    int fd = accept(fd_handoff_listen, NULL, NULL);
+    if (fd < 0)
+        perror("handoff accept");
+    else
+        __atomic_store_n(&fd_handoff_peer, fd, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// start listening for a successor
+int handoff_listen(void)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HandoffPath, sizeof(addr.sun_path) - 1);
+
+    fd_handoff_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_handoff_listen < 0) {
+        perror("handoff socket");
+        return 1;
+    }
+    unlink(HandoffPath);
+    if (bind(fd_handoff_listen, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(fd_handoff_listen, 1) < 0) {
+        perror("handoff bind");
+        return 1;
+    }
+
+    // wake up the blocking receive regularly so an idle input does
+    // not delay a pending handoff
+    input_timeout(200000);
+
+    thread_t t;
+    if (thread_start(&t, handoff_listener, NULL)) {
+        perror("handoff thread");
+        return 1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+// try to take over from a running instance, 0 if sockets were received
+int handoff_receive(void)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HandoffPath, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);  // nobody to take over from
+        return 1;
+    }
+
+    Handoff_t state;
+    struct iovec iov = { &state, sizeof(state) };
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t)sizeof(state) || cmsg == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        printf("handoff: bad message from running instance\n");
+        close(fd);
+        return 1;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (state.magic != HANDOFF_MAGIC || state.version != HANDOFF_VERSION) {
+        printf("handoff: incompatible running instance\n");
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    // stage states follow, the stages are not set up yet
+    for (int i = 0; i < HANDOFF_STATES; i++)
+    {
+        unsigned int len = state.state_len[i];
+        if (len == 0)
+            continue;
+        void* p = len <= HANDOFF_MAX_STATE ? malloc(len) : NULL;
+        if (p == NULL || recv(fd, p, len, MSG_WAITALL) != (ssize_t)len) {
+            // the stream is out of step, the next stages start cold too
+            printf("handoff: %s state not received, stages start cold\n", handoff_name[i]);
+            free(p);
+            break;
+        }
+        HandoffIn[i].p = p;
+        HandoffIn[i].len = len;
+        HandoffIn[i].key = state.state_key[i];
+    }
+    close(fd);
+
+    // destination comes from our own command line, it must be in the
+    // family of the output socket we were handed, else start afresh
+    Addr_t out;
+    socklen_t out_len = sizeof(out);
+    if (addr_parse(&addr_out, OutputMCast, OutputPort)
+        || getsockname(fds[1], &out.sa, &out_len) < 0
+        || out.sa.sa_family != addr_out.sa.sa_family) {
+        printf("handoff: output %s not in the family of the running instance's, not taking over\n", OutputMCast);
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    fd_in = fds[0];
+    fd_out = fds[1];
+    Stats = state.stats;
+
+    state.input_mcast[sizeof(state.input_mcast) - 1] = 0;
+    if (strcmp(state.input_mcast, InputMCast) || state.input_port != InputPort)
+        printf("handoff: warning, keeping input %s : %u of previous instance\n",
+            state.input_mcast, state.input_port);
+
+    printf("handoff: took over from running instance\n");
+    return 0;
+}
+
+// hand sockets and state to the successor, caller exits afterwards
+int handoff_send(int fd, const HandoffState_t* st)
+{
+    Handoff_t state;
+    memset(&state, 0, sizeof(state));
+    state.magic = HANDOFF_MAGIC;
+    state.version = HANDOFF_VERSION;
+    state.stats = Stats;
+    strncpy(state.input_mcast, InputMCast, sizeof(state.input_mcast) - 1);
+    state.input_port = InputPort;
+    for (int i = 0; i < HANDOFF_STATES; i++) {
+        state.state_len[i] = st[i].len;
+        state.state_key[i] = st[i].key;
+    }
+
+    struct iovec iov = { &state, sizeof(state) };
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { fd_in, fd_out };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int rc = sendmsg(fd, &msg, 0) == (ssize_t)sizeof(state) ? 0 : 1;
+    if (rc)
+        perror("handoff sendmsg");
+    for (int i = 0; i < HANDOFF_STATES && rc == 0; i++)
+        for (unsigned int done = 0; done < st[i].len && rc == 0; ) {
+            ssize_t n = send(fd, (char*)st[i].p + done, st[i].len - done, 0);
+            if (n <= 0) {
+                perror("handoff send");
+                rc = 1;
+            }
+            else
+                done += n;
+        }
+    close(fd);
+    return rc;
+}
+
+#endif // _WIN32
+
+//=======================================
+// Stats in shared memory (Linux only)
+//
+// Counters are copied into a POSIX shared memory segment under a
+// seqlock after each datagram: the writer makes the sequence odd,
+// copies, then makes it even again. Readers retry until they see the
+// same even sequence before and after their copy, so they get a
+// consistent snapshot without any syscall or lock on the data path.
+// Only the datagram counters are copied every time, the hardware and
+// TSC counters when they were updated, multi-route counters (one entry
+// per route after the segment) on the 100 ms tick of run_routes().
+
+#ifndef _WIN32
+
+#define STATS_SHM_MAGIC     0x54535053  // "TSPS"
+#define STATS_SHM_VERSION   12
+
+// History: fixed rings of per-interval counts at 3 resolutions,
+// each coarser sample being the sum of the finer ones. The counts are
+// 64 bit: an hour of TS packets at 1.2 Gbit/s no longer fits 32 bits
+#define HIST_1S_LEN     3600    // last hour at 1 s
+#define HIST_1M_LEN     1440    // last day at 1 min
+#define HIST_1H_LEN     168     // last week at 1 h
+#define HIST_MAX_PIDS   64      // PIDs with history, first seen first served
+#define HIST_PID_IDLE   3600    // a slot silent this long goes to a new PID
+
+typedef struct {
+    unsigned long long int udp;
+    unsigned long long int ts;
+    unsigned long long int patched;
+    unsigned long long int sync_err;
+} HistSample_t;
+
+typedef struct {
+    volatile unsigned int seq;
+    long long int last_sec;     // time of the last closed 1 s sample
+    unsigned int n_1s, n_1m, n_1h;  // samples written, ring index = n % len
+    HistSample_t s_1s[HIST_1S_LEN];
+    HistSample_t s_1m[HIST_1M_LEN];
+    HistSample_t s_1h[HIST_1H_LEN];
+    int n_pids;
+    unsigned short pid[HIST_MAX_PIDS];
+    long long int pid_seen[HIST_MAX_PIDS];  // last second with traffic
+    unsigned int pid_1s[HIST_MAX_PIDS][HIST_1S_LEN];
+    unsigned long long int pid_1m[HIST_MAX_PIDS][HIST_1M_LEN];
+    unsigned long long int pid_1h[HIST_MAX_PIDS][HIST_1H_LEN];
+
+    // writer side accumulators
+    Stats_t prev_stats;
+    unsigned long long int prev_sync_err;
+    unsigned long long int prev_pid[HIST_MAX_PIDS];
+    HistSample_t acc_1m, acc_1h;
+    unsigned long long int pid_acc_1m[HIST_MAX_PIDS], pid_acc_1h[HIST_MAX_PIDS];
+} History_t;
+
+// Multi-route mode (-r): load adaptation of each worker, see run_routes()
+#define SHM_MAX_WORKERS 64
+
+typedef struct {
+    double rate;                // datagrams/s, smoothed
+    int coalesce_us;            // idle sleep to let a batch build up
+    double udp_per_syscall;
+    unsigned long long int count_udp;
+    unsigned long long int cycles[STAGE_COUNT]; // -C, parse is part of patch
+} WorkerStats_t;
+
+typedef struct {
+    int n_workers;              // 0: single stream mode
+    double mean_batch;          // recvmmsg batch, mean over routes
+    WorkerStats_t workers[SHM_MAX_WORKERS];
+} RouteStats_t;
+
+RouteStats_t RouteStats;
+
+// multi-route mode: one per route, StatsShm_t.n_routes of them follow the segment
+typedef struct {
+    char in_desc[48];
+    int prio;
+    int shed;                   // parked by the overload control
+    Stats_t stats;
+    unsigned long long int drops;
+    unsigned long long int cycles[STAGE_COUNT]; // -C, parse is part of patch
+} RouteShm_t;
+
+#define STATS_SHM_PERF      1   // stats_shm_publish(): also copy the perf,
+#define STATS_SHM_CYCLES    2   // cycle or worker counters
+#define STATS_SHM_ROUTES    4
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    int pid;
+    int n_routes;               // RouteShm_t entries after the segment
+    volatile unsigned int seq;
+    Stats_t stats;
+    char input_mcast[ADDR_SPEC_LEN];
+    unsigned short input_port;
+    char output_mcast[ADDR_SPEC_LEN];
+    unsigned short output_port;
+    PerfStats_t perf;
+    int perf_task_clock;        // perf cycles are task clock ns
+    CycleStats_t cycles;
+    RouteStats_t routes;
+    History_t hist;             // own seqlock, updated once per second
+} StatsShm_t;
+
+#define STATS_SHM_HEADER    offsetof(StatsShm_t, hist)
+
+StatsShm_t* stats_shm = NULL;
+int StatsShmRoutes = 0;         // route entries to publish, set by run_routes()
+
+RouteShm_t* stats_shm_route(StatsShm_t* shm)
+{
+    return (RouteShm_t*)(shm + 1);
+}
+
+int stats_shm_create(void)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "/%s", StatsShmName);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        return 1;
+    }
+    size_t size = sizeof(StatsShm_t) + StatsShmRoutes * sizeof(RouteShm_t);
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return 1;
+    }
+    stats_shm = (StatsShm_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats_shm == MAP_FAILED) {
+        perror("mmap");
+        stats_shm = NULL;
+        return 1;
+    }
+
+    // readers see an odd sequence while the header is rewritten
+    __atomic_store_n(&stats_shm->seq, stats_shm->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // history survives a restart on the same segment, only the
+    // reference counters of this process are reset
+    History_t* h = &stats_shm->hist;
+    if (stats_shm->magic != STATS_SHM_MAGIC || stats_shm->version != STATS_SHM_VERSION)
+        memset(h, 0, sizeof(*h));
+    h->seq &= ~1u;
+    h->prev_stats = Stats;
+    h->prev_sync_err = 0;
+    memset(h->prev_pid, 0, sizeof(h->prev_pid));
+    if (h->last_sec == 0)
+        h->last_sec = time(NULL);
+
+    stats_shm->magic = STATS_SHM_MAGIC;
+    stats_shm->version = STATS_SHM_VERSION;
+    stats_shm->pid = getpid();
+    stats_shm->n_routes = StatsShmRoutes;
+    memset(stats_shm_route(stats_shm), 0, StatsShmRoutes * sizeof(RouteShm_t));
+    stats_shm->stats = Stats;
+    strncpy(stats_shm->input_mcast, InputMCast, sizeof(stats_shm->input_mcast) - 1);
+    stats_shm->input_port = InputPort;
+    strncpy(stats_shm->output_mcast, OutputMCast, sizeof(stats_shm->output_mcast) - 1);
+    stats_shm->output_port = OutputPort;
+    __atomic_store_n(&stats_shm->seq, stats_shm->seq + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// writer side of the seqlock, readers retry until stats_shm_end()
+unsigned int stats_shm_begin(void)
+{
+    unsigned int seq = stats_shm->seq;
+    __atomic_store_n(&stats_shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+void stats_shm_end(unsigned int seq)
+{
+    __atomic_store_n(&stats_shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// datagram counters, plus the STATS_SHM_* blocks that changed
+void stats_shm_publish(int what)
+{
+    if (stats_shm == NULL)
+        return;
+    unsigned int seq = stats_shm_begin();
+    stats_shm->stats = Stats;
+    if ((what & STATS_SHM_PERF) && fd_perf >= 0) {
+        stats_shm->perf = PerfStats;
+        stats_shm->perf_task_clock = perf_task_clock;
+    }
+    if ((what & STATS_SHM_CYCLES) && CycleAccounting)
+        stats_shm->cycles = CycleStats;
+    if (what & STATS_SHM_ROUTES)
+        stats_shm->routes = RouteStats;
+    stats_shm_end(seq);
+}
+
+void hist_push(HistSample_t* ring, unsigned int len, unsigned int* n, HistSample_t* s)
+{
+    ring[*n % len] = *s;
+    ++*n;
+}
+
+void hist_add(HistSample_t* acc, HistSample_t* s)
+{
+    acc->udp += s->udp;
+    acc->ts += s->ts;
+    acc->patched += s->patched;
+    acc->sync_err += s->sync_err;
+}
+
+// close one 1 s sample, fold it into the minute and hour accumulators
+void hist_close_second(History_t* h, HistSample_t* s, unsigned int* pid_s)
+{
+    h->last_sec++;
+    hist_push(h->s_1s, HIST_1S_LEN, &h->n_1s, s);
+    hist_add(&h->acc_1m, s);
+    for (int i = 0; i < h->n_pids; i++) {
+        h->pid_1s[i][(h->n_1s - 1) % HIST_1S_LEN] = pid_s[i];
+        h->pid_acc_1m[i] += pid_s[i];
+    }
+
+    if (h->last_sec % 60 == 0) {
+        hist_push(h->s_1m, HIST_1M_LEN, &h->n_1m, &h->acc_1m);
+        hist_add(&h->acc_1h, &h->acc_1m);
+        memset(&h->acc_1m, 0, sizeof(h->acc_1m));
+        for (int i = 0; i < h->n_pids; i++) {
+            h->pid_1m[i][(h->n_1m - 1) % HIST_1M_LEN] = h->pid_acc_1m[i];
+            h->pid_acc_1h[i] += h->pid_acc_1m[i];
+            h->pid_acc_1m[i] = 0;
+        }
+    }
+    if (h->last_sec % 3600 == 0) {
+        hist_push(h->s_1h, HIST_1H_LEN, &h->n_1h, &h->acc_1h);
+        memset(&h->acc_1h, 0, sizeof(h->acc_1h));
+        for (int i = 0; i < h->n_pids; i++) {
+            h->pid_1h[i][(h->n_1h - 1) % HIST_1H_LEN] = h->pid_acc_1h[i];
+            h->pid_acc_1h[i] = 0;
+        }
+    }
+}
+
+// clear k slots of a ring of len elements starting at sample n
+void hist_clear(void* ring, size_t size, unsigned int len, unsigned int n, long long int k)
+{
+    if (k >= len) {
+        memset(ring, 0, size * len);
+        return;
+    }
+    unsigned int first = n % len;
+    unsigned int head = (unsigned int)k < len - first ? (unsigned int)k : len - first;
+    memset((char*)ring + first * size, 0, head * size);
+    memset(ring, 0, ((unsigned int)k - head) * size);
+}
+
+// close k empty seconds after a gap without walking them: the
+// accumulators only hold data up to the first boundary crossed, every
+// sample after it is zero, so whole ranges of each ring are cleared
+void hist_skip(History_t* h, long long int k)
+{
+    long long int from = h->last_sec, to = from + k;
+    hist_clear(h->s_1s, sizeof(*h->s_1s), HIST_1S_LEN, h->n_1s, k);
+    for (int i = 0; i < h->n_pids; i++)
+        hist_clear(h->pid_1s[i], sizeof(**h->pid_1s), HIST_1S_LEN, h->n_1s, k);
+    h->n_1s += (unsigned int)k;
+    h->last_sec = to;
+
+    long long int minutes = to / 60 - from / 60;
+    if (minutes > 0) {
+        hist_push(h->s_1m, HIST_1M_LEN, &h->n_1m, &h->acc_1m);
+        hist_add(&h->acc_1h, &h->acc_1m);
+        memset(&h->acc_1m, 0, sizeof(h->acc_1m));
+        for (int i = 0; i < h->n_pids; i++) {
+            h->pid_1m[i][(h->n_1m - 1) % HIST_1M_LEN] = h->pid_acc_1m[i];
+            h->pid_acc_1h[i] += h->pid_acc_1m[i];
+            h->pid_acc_1m[i] = 0;
+        }
+        hist_clear(h->s_1m, sizeof(*h->s_1m), HIST_1M_LEN, h->n_1m, minutes - 1);
+        for (int i = 0; i < h->n_pids; i++)
+            hist_clear(h->pid_1m[i], sizeof(**h->pid_1m), HIST_1M_LEN, h->n_1m, minutes - 1);
+        h->n_1m += (unsigned int)(minutes - 1);
+    }
+
+    long long int hours = to / 3600 - from / 3600;
+    if (hours > 0) {
+        hist_push(h->s_1h, HIST_1H_LEN, &h->n_1h, &h->acc_1h);
+        memset(&h->acc_1h, 0, sizeof(h->acc_1h));
+        for (int i = 0; i < h->n_pids; i++) {
+            h->pid_1h[i][(h->n_1h - 1) % HIST_1H_LEN] = h->pid_acc_1h[i];
+            h->pid_acc_1h[i] = 0;
+        }
+        hist_clear(h->s_1h, sizeof(*h->s_1h), HIST_1H_LEN, h->n_1h, hours - 1);
+        for (int i = 0; i < h->n_pids; i++)
+            hist_clear(h->pid_1h[i], sizeof(**h->pid_1h), HIST_1H_LEN, h->n_1h, hours - 1);
+        h->n_1h += (unsigned int)(hours - 1);
+    }
+}
+
+// hand a history slot to a PID, empty or silent for HIST_PID_IDLE
+int hist_pid_slot(History_t* h, int pid, long long int now)
+{
+    int i = h->n_pids;
+    if (i == HIST_MAX_PIDS) {
+        for (i = 0; i < h->n_pids; i++)
+            if (now - h->pid_seen[i] > HIST_PID_IDLE)
+                break;
+        if (i == h->n_pids)
+            return -1;
+    }
+    else
+        h->n_pids++;
+    h->pid[i] = (unsigned short)pid;
+    h->prev_pid[i] = 0;
+    h->pid_acc_1m[i] = 0;
+    h->pid_acc_1h[i] = 0;
+    memset(h->pid_1s[i], 0, sizeof(h->pid_1s[i]));
+    memset(h->pid_1m[i], 0, sizeof(h->pid_1m[i]));
+    memset(h->pid_1h[i], 0, sizeof(h->pid_1h[i]));
+    return i;
+}
+
+// PID counters at the previous history sample, to spot PIDs with traffic
+unsigned long long int HistPidCount[PID_COUNT];
+
+// called from the receive loop, does nothing until a second has elapsed
+void stats_shm_history(time_t now)
+{
+    if (stats_shm == NULL || now <= stats_shm->hist.last_sec)
+        return;
+    History_t* h = &stats_shm->hist;
+
+    unsigned int seq = h->seq;
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // start history for PIDs with traffic and no slot yet
+    for (int pid = 0; pid < PID_COUNT; pid++) {
+        if (PidStats.count_pid[pid] == HistPidCount[pid])
+            continue;
+        HistPidCount[pid] = PidStats.count_pid[pid];
+        int i = 0;
+        while (i < h->n_pids && h->pid[i] != pid)
+            i++;
+        if (i == h->n_pids && (i = hist_pid_slot(h, pid, now)) < 0)
+            continue;
+        h->pid_seen[i] = now;
+    }
+
+    // everything since the last sample goes in the first elapsed
+    // second, the following ones (no traffic seen) are empty
+    HistSample_t sample;
+    sample.udp = Stats.count_udp - h->prev_stats.count_udp;
+    sample.ts = Stats.count_ts - h->prev_stats.count_ts;
+    sample.patched = Stats.count_patched - h->prev_stats.count_patched;
+    sample.sync_err = PidStats.count_sync_err - h->prev_sync_err;
+    unsigned int pid_sample[HIST_MAX_PIDS];
+    for (int i = 0; i < h->n_pids; i++) {
+        unsigned long long int c = PidStats.count_pid[h->pid[i]];
+        pid_sample[i] = (unsigned int)(c - h->prev_pid[i]);
+        h->prev_pid[i] = c;
+    }
+    h->prev_stats = Stats;
+    h->prev_sync_err = PidStats.count_sync_err;
+
+    hist_close_second(h, &sample, pid_sample);
+    if (h->last_sec < now)
+        hist_skip(h, now - h->last_sec);
+
+    __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// consistent copy of size bytes of a seqlock protected block
+void seqlock_read(volatile unsigned int* seqp, void* dst, const void* src, size_t size)
+{
+    unsigned int seq;
+    do {
+        while ((seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(dst, src, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(seqp, __ATOMIC_RELAXED) != seq);
+}
+
+// consistent copy of the counters, retries while a write is in progress
+void stats_shm_read(StatsShm_t* shm, StatsShm_t* snap)
+{
+    seqlock_read(&shm->seq, snap, shm, STATS_SHM_HEADER);
+}
+
+// print one history ring, oldest first, optionally for a single PID
+void print_history(History_t* h, const char* res, int pid)
+{
+    HistSample_t* ring = h->s_1s;
+    unsigned int len = HIST_1S_LEN, n = h->n_1s, step = 1;
+    if (!strcmp(res, "1m")) {
+        ring = h->s_1m; len = HIST_1M_LEN; n = h->n_1m; step = 60;
+    }
+    else if (!strcmp(res, "1h")) {
+        ring = h->s_1h; len = HIST_1H_LEN; n = h->n_1h; step = 3600;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < h->n_pids; i++)
+        if (h->pid[i] == pid)
+            slot = i;
+    if (pid >= 0 && slot < 0) {
+        printf("no history for PID %d\n", pid);
+        return;
+    }
+
+    // last sample of each ring ends on the last closed boundary
+    long long int end = h->last_sec - h->last_sec % step;
+    unsigned int count = n < len ? n : len;
+    for (unsigned int k = n - count; k < n; k++) {
+        time_t t = (time_t)(end - (long long int)(n - k) * step);
+        struct tm* tm = localtime(&t);
+        char tbuf[32];
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm);
+
+        HistSample_t* s = &ring[k % len];
+        if (slot < 0) {
+            printf("%s %10.3f Mbit/s %10llu UDP %12llu TS %12llu patched %6llu sync errors\n",
+                tbuf, s->ts * (double)TS_LEN * 8 / step / 1e6, s->udp, s->ts, s->patched, s->sync_err);
+        }
+        else {
+            unsigned long long int ts = step == 1 ? h->pid_1s[slot][k % len]
+                : step == 60 ? h->pid_1m[slot][k % len] : h->pid_1h[slot][k % len];
+            printf("%s PID %4d %10.3f Mbit/s %12llu TS\n",
+                tbuf, pid, ts * (double)TS_LEN * 8 / step / 1e6, ts);
+        }
+    }
+}
+
+#define TOP_ROUTES  10       // busiest routes shown
+
+// route lines of one display, all routes or only the one selected
+void top_routes(RouteShm_t* prev, RouteShm_t* snap, int n_routes, int route)
+{
+    int shown[TOP_ROUTES];
+    int n_shown = 0;
+    if (route >= 0)
+        shown[n_shown++] = route;
+    while (route < 0 && n_shown < TOP_ROUTES) {
+        int best = -1;
+        unsigned long long int best_udp = 0;
+        for (int r = 0; r < n_routes; r++) {
+            unsigned long long int udp = snap[r].stats.count_udp - prev[r].stats.count_udp;
+            int taken = 0;
+            for (int k = 0; k < n_shown; k++)
+                taken |= shown[k] == r;
+            if (!taken && (best < 0 || udp > best_udp)) {
+                best = r;
+                best_udp = udp;
+            }
+        }
+        if (best < 0)
+            break;
+        shown[n_shown++] = best;
+    }
+    for (int k = 0; k < n_shown; k++) {
+        RouteShm_t* p = &prev[shown[k]];
+        RouteShm_t* c = &snap[shown[k]];
+        unsigned long long int udp = c->stats.count_udp - p->stats.count_udp;
+        printf("  r%-5d %-24s prio %3d %8llu UDP/s %8.3f Mbit/s %12llu UDP %8llu send errors %8llu drops",
+            shown[k], c->in_desc, c->prio, udp, (c->stats.count_ts - p->stats.count_ts) * TS_LEN * 8 / 1e6,
+            c->stats.count_udp, c->stats.count_send_err, c->drops);
+        if (c->cycles[STAGE_RECEIVE] != 0 && udp > 0)
+            printf(" %6llu rx %6llu patch %6llu tx cycles/UDP",
+                (c->cycles[STAGE_RECEIVE] - p->cycles[STAGE_RECEIVE]) / udp,
+                (c->cycles[STAGE_PATCH] - p->cycles[STAGE_PATCH]) / udp,
+                (c->cycles[STAGE_SEND] - p->cycles[STAGE_SEND]) / udp);
+        printf("%s\n", c->shed ? "  shed" : "");
+    }
+}
+
+// tspidfilter-top: attach to a published segment and display rates,
+// or dump a history ring; route >= 0 shows that route only
+int run_top(char* name, char* res, int pid, int route)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    StatsShm_t* shm = (StatsShm_t*)mmap(NULL, sizeof(StatsShm_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+
+    StatsShm_t prev, snap;
+    stats_shm_read(shm, &prev);
+    if (prev.magic != STATS_SHM_MAGIC || prev.version != STATS_SHM_VERSION) {
+        printf("%s: not a tspidfilter stats segment\n", name);
+        close(fd);
+        return 1;
+    }
+
+    // the route counters follow the segment, map them too
+    int n_routes = prev.n_routes;
+    RouteShm_t* routes_prev = NULL;
+    RouteShm_t* routes_snap = NULL;
+    if (n_routes > 0) {
+        munmap(shm, sizeof(StatsShm_t));
+        shm = (StatsShm_t*)mmap(NULL, sizeof(StatsShm_t) + n_routes * sizeof(RouteShm_t), PROT_READ, MAP_SHARED, fd, 0);
+        routes_prev = (RouteShm_t*)malloc(n_routes * sizeof(RouteShm_t));
+        routes_snap = (RouteShm_t*)malloc(n_routes * sizeof(RouteShm_t));
+        if (shm == MAP_FAILED || routes_prev == NULL || routes_snap == NULL) {
+            perror("routes");
+            close(fd);
+            return 1;
+        }
+        seqlock_read(&shm->seq, routes_prev, stats_shm_route(shm), n_routes * sizeof(RouteShm_t));
+    }
+    close(fd);
+    if (route >= n_routes) {
+        printf("%s: no route %d, %d routes\n", name, route, n_routes);
+        return 1;
+    }
+    if (prev.routes.n_workers > 0)
+        printf("pid %d, routes %s\n", prev.pid, prev.input_mcast);
+    else
+        printf("pid %d, %s : %u -> %s : %u\n", prev.pid,
+            prev.input_mcast, prev.input_port, prev.output_mcast, prev.output_port);
+
+    if (res != NULL)
+    {
+        History_t* h = (History_t*)malloc(sizeof(History_t));
+        if (h == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        seqlock_read(&shm->hist.seq, h, &shm->hist, sizeof(History_t));
+        print_history(h, res, pid);
+        free(h);
+        return 0;
+    }
+
+    while (1) {
+        sleep(1);
+        stats_shm_read(shm, &snap);
+        printf("%8llu UDP/s, %8llu TS/s, %8llu patched/s, %8.3f Mbit/s | %12llu UDP, %14llu TS, %14llu patched\n",
+            snap.stats.count_udp - prev.stats.count_udp,
+            snap.stats.count_ts - prev.stats.count_ts,
+            snap.stats.count_patched - prev.stats.count_patched,
+            (snap.stats.count_ts - prev.stats.count_ts) * TS_LEN * 8 / 1e6,
+            snap.stats.count_udp, snap.stats.count_ts, snap.stats.count_patched);
+        if (snap.perf.samples > 0) {
+            PerfStats = snap.perf;
+            perf_task_clock = snap.perf_task_clock;
+            perf_print();
+        }
+        if (snap.cycles.tsc_start != 0)
+            cycles_print(&snap.cycles);
+        if (snap.routes.n_workers > 0)
+            printf("  mean batch %.1f\n", snap.routes.mean_batch);
+        for (int i = 0; i < snap.routes.n_workers; i++) {
+            WorkerStats_t* w = &snap.routes.workers[i];
+            WorkerStats_t* p = &prev.routes.workers[i];
+            unsigned long long int udp = w->count_udp - p->count_udp;
+            printf("  w%-3d %10.0f UDP/s %5d us coalesce %6.2f UDP/syscall",
+                i, w->rate, w->coalesce_us, w->udp_per_syscall);
+            if (w->cycles[STAGE_RECEIVE] != 0 && udp > 0)
+                printf(" %6llu rx %6llu patch %6llu tx cycles/UDP",
+                    (w->cycles[STAGE_RECEIVE] - p->cycles[STAGE_RECEIVE]) / udp,
+                    (w->cycles[STAGE_PATCH] - p->cycles[STAGE_PATCH]) / udp,
+                    (w->cycles[STAGE_SEND] - p->cycles[STAGE_SEND]) / udp);
+            printf("\n");
+        }
+        if (n_routes > 0) {
+            seqlock_read(&shm->seq, routes_snap, stats_shm_route(shm), n_routes * sizeof(RouteShm_t));
+            top_routes(routes_prev, routes_snap, n_routes, route);
+            RouteShm_t* t = routes_prev;
+            routes_prev = routes_snap;
+            routes_snap = t;
+        }
+        fflush(stdout);
+        prev = snap;
+    }
+    return 0;
+}
+
+#endif // _WIN32
+
+//=======================================
+// Benchmark traffic generator and sink (Linux only)
+//
+// -G sends N synthetic streams to consecutive groups at a fixed rate.
+// Each datagram starts with a null packet carrying the stream index,
+// a sequence number and the send time, which the filter leaves alone;
+// the other packets use PIDs 100..105. -K joins the same N groups on
+// the filtered side and reports loss, throughput and latency as JSON.
+
+#ifndef _WIN32
+
+#define BENCH_MAGIC     0x54535042  // "TSPB"
+#define BENCH_TS        7
+#define BENCH_PIDS      6
+#define BENCH_LAT_US    100000      // latency histogram range, 1 us buckets
+
+typedef struct {
+    unsigned int magic;
+    unsigned int stream;
+    unsigned long long int seq;
+    unsigned long long int t_ns;
+} BenchTag_t;
+
+unsigned long long int mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// nanosleep() of any length, tv_nsec must stay below 1 s
+void sleep_ns(unsigned long long int ns)
+{
+    struct timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+    nanosleep(&ts, NULL);
+}
+
+// group i of a run: base address + i
+void bench_group(struct sockaddr_in* addr, const char* base, unsigned short port, int i)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, base, &addr->sin_addr.s_addr);
+    addr->sin_addr.s_addr = htonl(ntohl(addr->sin_addr.s_addr) + i);
+    addr->sin_port = htons(port);
+}
+
+// -G mcast_base port n_streams mbit_per_stream seconds
+int run_generator(int argc, char** argv)
+{
+    if (argc != 5) {
+        printf("usage  : -G mcast_base port n_streams mbit_per_stream seconds\n");
+        return 1;
+    }
+    const char* base = argv[0];
+    unsigned short port = atoi(argv[1]);
+    int n_streams = atoi(argv[2]);
+    double mbit = atof(argv[3]);
+    double seconds = atof(argv[4]);
+    if (n_streams <= 0 || mbit <= 0) {
+        printf("bad stream count or rate\n");
+        return 1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unsigned char ttl = 4;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    struct sockaddr_in* dst = (struct sockaddr_in*)malloc(n_streams * sizeof(*dst));
+    unsigned long long int* seq = (unsigned long long int*)calloc(n_streams, sizeof(*seq));
+    if (dst == NULL || seq == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < n_streams; i++)
+        bench_group(&dst[i], base, port, i);
+
+    unsigned char buf[BENCH_TS * TS_LEN];
+    memset(buf, 0xFF, sizeof(buf));
+    for (int k = 0; k < BENCH_TS; k++) {
+        TSHDR_t* h = (TSHDR_t*)(buf + k * TS_LEN);
+        h->sync = TS_SYNC;
+        h->tei = h->pusi = h->tp = 0;
+        set_pid(h, k == 0 ? PID_NULL : 100 + (k - 1) % BENCH_PIDS);
+        h->tfc = 0;
+        h->afc = 1;
+        h->cc = 0;
+    }
+
+    // one datagram per stream every interval, sent back to back
+    unsigned long long int interval = (unsigned long long int)(sizeof(buf) * 8 / (mbit * 1e6) * 1e9);
+    unsigned long long int start = mono_ns();
+    unsigned long long int end = start + (unsigned long long int)(seconds * 1e9);
+    unsigned long long int next = start;
+    unsigned long long int n_sent = 0;
+
+    while (next < end)
+    {
+        unsigned long long int now = mono_ns();
+        if (now < next) {
+            sleep_ns(next - now);
+            continue;
+        }
+        for (int i = 0; i < n_streams; i++) {
+            BenchTag_t tag = { BENCH_MAGIC, (unsigned int)i, seq[i]++, mono_ns() };
+            memcpy(buf + 4, &tag, sizeof(tag));
+            for (int k = 1; k < BENCH_TS; k++)
+                ((TSHDR_t*)(buf + k * TS_LEN))->cc++;
+            if (sendto(fd, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&dst[i], sizeof(dst[i])) == (ssize_t)sizeof(buf))
+                n_sent++;
+        }
+        next += interval;
+    }
+
+    printf("{\"sent\": %llu}\n", n_sent);
+    free(dst);
+    free(seq);
+    close(fd);
+    return 0;
+}
+
+// -K mcast_base port n_streams seconds
+int run_sink(int argc, char** argv)
+{
+    if (argc != 4) {
+        printf("usage  : -K mcast_base port n_streams seconds\n");
+        return 1;
+    }
+    const char* base = argv[0];
+    unsigned short port = atoi(argv[1]);
+    int n_streams = atoi(argv[2]);
+    double seconds = atof(argv[3]);
+    if (n_streams <= 0) {
+        printf("bad stream count\n");
+        return 1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
+    int rcvbuf = 16 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    for (int i = 0; i < n_streams; i++) {
+        struct ip_mreq mreq;
+        bench_group(&addr, base, port, i);
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) < 0) {
+            perror("IP_ADD_MEMBERSHIP");
+            return 1;
+        }
+    }
+    struct timeval tv = { 0, 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+
+    unsigned long long int* received = (unsigned long long int*)calloc(n_streams, sizeof(unsigned long long int));
+    unsigned long long int* first_seq = (unsigned long long int*)calloc(n_streams, sizeof(unsigned long long int));
+    unsigned long long int* last_seq = (unsigned long long int*)calloc(n_streams, sizeof(unsigned long long int));
+    unsigned int* lat_hist = (unsigned int*)calloc(BENCH_LAT_US + 1, sizeof(unsigned int));
+    if (received == NULL || first_seq == NULL || last_seq == NULL || lat_hist == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    unsigned long long int bytes = 0, n_bad = 0, n_total = 0, n_patched = 0;
+    unsigned long long int end = mono_ns() + (unsigned long long int)(seconds * 1e9);
+    unsigned long long int t_first = 0, t_last = 0;
+
+    while (mono_ns() < end)
+    {
+        int n = recv(fd, (char*)msgbuf, MSGBUFSIZE, 0);
+        if (n < 0)
+            continue;
+        BenchTag_t tag;
+        memcpy(&tag, msgbuf + 4, sizeof(tag));
+        if (n != BENCH_TS * TS_LEN || tag.magic != BENCH_MAGIC || tag.stream >= (unsigned int)n_streams) {
+            n_bad++;
+            continue;
+        }
+        unsigned long long int now = mono_ns();
+        if (t_first == 0)
+            t_first = now;
+        t_last = now;
+
+        if (received[tag.stream]++ == 0)
+            first_seq[tag.stream] = tag.seq;
+        if (tag.seq > last_seq[tag.stream])
+            last_seq[tag.stream] = tag.seq;
+        unsigned long long int lat_us = (now - tag.t_ns) / 1000;
+        lat_hist[lat_us < BENCH_LAT_US ? lat_us : BENCH_LAT_US]++;
+        for (int k = 1; k < BENCH_TS; k++)
+            if (get_pid((TSHDR_t*)(msgbuf + k * TS_LEN)) == PID_NULL)
+                n_patched++;
+        bytes += n;
+        n_total++;
+    }
+
+    unsigned long long int expected = 0;
+    for (int i = 0; i < n_streams; i++)
+        if (received[i])
+            expected += last_seq[i] - first_seq[i] + 1;
+    unsigned long long int lost = expected > n_total ? expected - n_total : 0;
+
+    // percentiles from the 1 us histogram, last bucket is "or more"
+    double pct[4] = { 0.50, 0.99, 0.999, 1.0 };
+    unsigned long long int pval[4] = { 0, 0, 0, 0 };
+    for (int p = 0; p < 4; p++) {
+        unsigned long long int target = (unsigned long long int)(pct[p] * n_total + 0.5), acc = 0;
+        for (int us = 0; us <= BENCH_LAT_US; us++) {
+            acc += lat_hist[us];
+            if (acc >= target && target > 0) {
+                pval[p] = us;
+                break;
+            }
+        }
+    }
+
+    double span = t_last > t_first ? (t_last - t_first) / 1e9 : 0;
+    printf("{\"streams\": %d, \"received\": %llu, \"lost\": %llu, \"loss_ratio\": %.9f, "
+        "\"bad\": %llu, \"patched_ts\": %llu, \"mbit_s\": %.3f, "
+        "\"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+        n_streams, n_total, lost, expected ? (double)lost / expected : 0.0,
+        n_bad, n_patched, span > 0 ? bytes * 8 / span / 1e6 : 0.0,
+        pval[0], pval[1], pval[2], pval[3]);
+
+    free(received);
+    free(first_seq);
+    free(last_seq);
+    free(lat_hist);
+    close(fd);
+    return 0;
+}
+
+//=======================================
+// PCR paced replayer (Linux only)
+//
+// -R sends a capture (or a synthetic mux) to multicast at the pace
+// given by its PCRs. The capture is mapped in memory and the PCR
+// positions of the first PCR PID are indexed once: the send time of a
+// packet is interpolated between the two PCRs around it, with the
+// rate of the neighbouring segment across PCR discontinuities.
+// Looping shifts all PCRs by the loop duration and CCs by the per-PID
+// CC advance of one pass, so the output stays continuous (PTS/DTS are
+// left untouched). Due datagrams are sent in sendmmsg() batches.
+
+#define REPLAY_BATCH    64
+#define RTP_HDR_LEN     12
+
+typedef struct {
+    unsigned char* ts;          // packets, mapped file or synthetic
+    long long int n_ts;
+    int pcr_pid;
+    long long int n_anchors;
+    long long int* anchor_pkt;  // packet index of each PCR
+    double* anchor_t;           // monotonic time of each PCR, 27 MHz
+    double t_first;             // time from packet 0 to the first PCR, 27 MHz
+    double loop_t;              // duration of one pass, 27 MHz
+    unsigned char cc_step[PID_COUNT];
+    long long int cursor;       // anchor before the last packet timed
+} Replay_t;
+
+// build a mux of n_pids PIDs from 100 up, PCR on PID 100 every 20 ms
+int replay_synth(Replay_t* r, int n_pids, double mbit)
+{
+    double pkt_per_s = mbit * 1e6 / (TS_LEN * 8);
+    r->n_ts = (long long int)pkt_per_s;             // one second per pass
+    int pcr_every = (int)(pkt_per_s / 50) + 1;
+    if (r->n_ts < 2 || n_pids <= 0) {
+        printf("synthetic mux too small\n");
+        return 1;
+    }
+    r->ts = (unsigned char*)malloc(r->n_ts * TS_LEN);
+    if (r->ts == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    unsigned char cc[PID_COUNT] = { 0 };
+    for (long long int k = 0; k < r->n_ts; k++) {
+        unsigned char* ts = r->ts + k * TS_LEN;
+        TSHDR_t* h = (TSHDR_t*)ts;
+        int with_pcr = k % pcr_every == 0;
+        int pid = with_pcr ? 100 : 100 + (int)(k % n_pids);
+        memset(ts, 0xFF, TS_LEN);
+        h->sync = TS_SYNC;
+        h->tei = h->pusi = h->tp = 0;
+        set_pid(h, pid);
+        h->tfc = 0;
+        h->cc = cc[pid]++;
+        h->afc = 1;
+        if (with_pcr) {
+            h->afc = 3;
+            ts[4] = 7;
+            ts[5] = 0x10;
+            set_pcr(ts, (unsigned long long int)(k * PCR_HZ / pkt_per_s) % PCR_WRAP);
+        }
+    }
+    return 0;
+}
+
+int replay_index(Replay_t* r)
+{
+    r->pcr_pid = -1;
+    long long int n = 0;
+    unsigned long long int pcr;
+    for (long long int k = 0; k < r->n_ts; k++) {
+        unsigned char* ts = r->ts + k * TS_LEN;
+        if (r->pcr_pid < 0 && get_pcr(ts, &pcr))
+            r->pcr_pid = get_pid((TSHDR_t*)ts);
+        if ((int)get_pid((TSHDR_t*)ts) == r->pcr_pid && get_pcr(ts, &pcr))
+            n++;
+    }
+    if (n < 2) {
+        printf("replay: need at least 2 PCRs\n");
+        return 1;
+    }
+    r->anchor_pkt = (long long int*)malloc(n * sizeof(long long int));
+    r->anchor_t = (double*)malloc(n * sizeof(double));
+    if (r->anchor_pkt == NULL || r->anchor_t == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // anchors on a monotonic clock, discontinuities bridged at the
+    // rate of the previous segment
+    unsigned long long int prev_pcr = 0;
+    double rate = 0;    // 27 MHz ticks per packet
+    r->n_anchors = 0;
+    for (long long int k = 0; k < r->n_ts; k++) {
+        unsigned char* ts = r->ts + k * TS_LEN;
+        if ((int)get_pid((TSHDR_t*)ts) != r->pcr_pid || !get_pcr(ts, &pcr))
+            continue;
+        long long int i = r->n_anchors++;
+        r->anchor_pkt[i] = k;
+        if (i == 0)
+            r->anchor_t[i] = 0;
+        else {
+            unsigned long long int delta = (pcr + PCR_WRAP - prev_pcr) % PCR_WRAP;
+            long long int pkts = k - r->anchor_pkt[i - 1];
+            if (delta == 0 || delta > PCR_HZ || pkts == 0)
+                delta = (unsigned long long int)(rate * pkts);
+            else
+                rate = (double)delta / pkts;
+            r->anchor_t[i] = r->anchor_t[i - 1] + delta;
+        }
+        prev_pcr = pcr;
+    }
+    if (rate == 0) {
+        printf("replay: no usable PCR interval\n");
+        return 1;
+    }
+
+    // one pass lasts up to the packet after the last one
+    r->cursor = 0;
+    r->loop_t = 0;
+    long long int last = r->n_anchors - 1;
+    double last_rate = (r->anchor_t[last] - r->anchor_t[last - 1])
+        / (r->anchor_pkt[last] - r->anchor_pkt[last - 1]);
+    double first_rate = (r->anchor_t[1] - r->anchor_t[0]) / (r->anchor_pkt[1] - r->anchor_pkt[0]);
+    r->t_first = r->anchor_pkt[0] * first_rate;
+    r->loop_t = r->t_first + r->anchor_t[last] + (r->n_ts - r->anchor_pkt[last]) * last_rate;
+
+    // CC advance of one pass per PID: first CC of the next pass follows the last one
+    int first_cc[PID_COUNT], last_cc[PID_COUNT];
+    for (int pid = 0; pid < PID_COUNT; pid++)
+        first_cc[pid] = last_cc[pid] = -1;
+    for (long long int k = 0; k < r->n_ts; k++) {
+        TSHDR_t* h = (TSHDR_t*)(r->ts + k * TS_LEN);
+        int pid = get_pid(h);
+        if (!(h->afc & 1))
+            continue;
+        if (first_cc[pid] < 0)
+            first_cc[pid] = h->cc;
+        last_cc[pid] = h->cc;
+    }
+    for (int pid = 0; pid < PID_COUNT; pid++)
+        r->cc_step[pid] = first_cc[pid] < 0 || pid == PID_NULL ? 0
+            : (unsigned char)((last_cc[pid] + 1 - first_cc[pid]) & 15);
+    return 0;
+}
+
+// time of packet k within a pass, 27 MHz from packet 0; k mostly increases
+double replay_time(Replay_t* r, long long int k)
+{
+    if (k < r->anchor_pkt[r->cursor])
+        r->cursor = 0;
+    while (r->cursor + 2 < r->n_anchors && r->anchor_pkt[r->cursor + 1] <= k)
+        r->cursor++;
+    long long int a = r->cursor;
+    double rate = (r->anchor_t[a + 1] - r->anchor_t[a]) / (r->anchor_pkt[a + 1] - r->anchor_pkt[a]);
+    return r->t_first + r->anchor_t[a] + (k - r->anchor_pkt[a]) * rate;
+}
+
+// -R [-rtp] [-loop] [-n ts_per_udp] [-t seconds] file.ts|synth:pids:mbit mcast port
+// send a whole batch, returns the datagrams sent. sendmmsg() stops
+// short at a datagram that fails, that one is counted as dropped (error
+// printed once per batch) and the rest is sent again
+int replay_send(int fd, struct mmsghdr* msgs, int n_batch, unsigned long long int* n_dropped)
+{
+    int done = 0, sent = 0, failed = 0;
+    while (done < n_batch) {
+        int n = sendmmsg(fd, msgs + done, n_batch - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (failed++ == 0)
+                perror("sendmmsg");
+            ++*n_dropped;
+            done++;
+            continue;
+        }
+        done += n;
+        sent += n;
+    }
+    return sent;
+}
+
+int run_replay(int argc, char** argv)
+{
+    int rtp = 0, loop = 0, ts_per_udp = 7, arg = 0;
+    double seconds = 0;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (!strcmp(argv[arg], "-rtp"))
+            rtp = 1;
+        else if (!strcmp(argv[arg], "-loop"))
+            loop = 1;
+        else if (!strcmp(argv[arg], "-n") && arg + 1 < argc)
+            ts_per_udp = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "-t") && arg + 1 < argc)
+            seconds = atof(argv[++arg]);
+        else
+            break;
+        arg++;
+    }
+    if (argc - arg != 3 || ts_per_udp < 1 || ts_per_udp * TS_LEN + RTP_HDR_LEN > 65507) {
+        printf("usage  : -R [-rtp] [-loop] [-n ts_per_udp] [-t seconds] file.ts|synth:pids:mbit mcast port\n");
+        return 1;
+    }
+    const char* src = argv[arg];
+
+    Replay_t r;
+    memset(&r, 0, sizeof(r));
+    if (!strncmp(src, "synth:", 6)) {
+        int n_pids = 0;
+        double mbit = 0;
+        if (sscanf(src + 6, "%d:%lf", &n_pids, &mbit) != 2 || replay_synth(&r, n_pids, mbit))
+            return 1;
+    }
+    else {
+        int fd = open(src, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(src);
+            return 1;
+        }
+        r.n_ts = st.st_size / TS_LEN;
+        r.ts = r.n_ts ? (unsigned char*)mmap(NULL, r.n_ts * TS_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+            : (unsigned char*)MAP_FAILED;
+        close(fd);
+        if (r.ts == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        madvise(r.ts, r.n_ts * TS_LEN, MADV_SEQUENTIAL);
+    }
+    if (replay_index(&r))
+        return 1;
+    printf("replay: %lld TS, PCR PID %d, %.3f s per pass, %.3f Mbit/s\n", r.n_ts, r.pcr_pid,
+        r.loop_t / PCR_HZ, r.n_ts * TS_LEN * 8 / (r.loop_t / PCR_HZ) / 1e6);
+
+    Addr_t dst;
+    if (addr_parse(&dst, argv[arg + 1], atoi(argv[arg + 2])))
+        return 1;
+    int fd = socket(dst.sa.sa_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int ttl = 4;
+    if (dst.sa.sa_family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+    else {
+        unsigned char ttl4 = ttl;
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl4, sizeof(ttl4));
+    }
+    int sndbuf = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char*)&sndbuf, sizeof(sndbuf));
+
+    int dgram_len = (rtp ? RTP_HDR_LEN : 0) + ts_per_udp * TS_LEN;
+    unsigned char* bufs = (unsigned char*)malloc(REPLAY_BATCH * dgram_len);
+    if (bufs == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    struct mmsghdr msgs[REPLAY_BATCH];
+    struct iovec iovs[REPLAY_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    unsigned short rtp_seq = 0;
+    unsigned int rtp_ssrc = (unsigned int)getpid();
+    unsigned long long int start = mono_ns();
+    unsigned long long int n_sent = 0, n_dropped = 0, n_pass = 0;
+    long long int k = 0;
+    int n_batch = 0;
+
+    while (1)
+    {
+        if (k >= r.n_ts) {
+            if (!loop)
+                break;
+            k = 0;
+            n_pass++;
+        }
+
+        // due time of this datagram, first packet
+        double t = n_pass * r.loop_t + replay_time(&r, k);
+        if (seconds > 0 && t >= seconds * PCR_HZ)
+            break;
+        unsigned long long int due = start + (unsigned long long int)(t * 1000 / 27);
+        unsigned long long int now = mono_ns();
+        if (due > now) {
+            if (n_batch > 0) {
+                n_sent += replay_send(fd, msgs, n_batch, &n_dropped);
+                n_batch = 0;
+                now = mono_ns();
+            }
+            if (due > now + 50000)
+                sleep_ns(due - now - 20000);
+            while (mono_ns() < due)
+                ;
+        }
+
+        // build the datagram, rewriting CC and PCR after the first pass
+        unsigned char* d = bufs + n_batch * dgram_len;
+        unsigned char* p = d;
+        if (rtp) {
+            unsigned int ts90 = (unsigned int)(t / 300);
+            p[0] = 0x80;
+            p[1] = 33;  // MP2T
+            p[2] = rtp_seq >> 8;
+            p[3] = rtp_seq & 0xFF;
+            p[4] = ts90 >> 24;
+            p[5] = ts90 >> 16;
+            p[6] = ts90 >> 8;
+            p[7] = ts90;
+            p[8] = rtp_ssrc >> 24;
+            p[9] = rtp_ssrc >> 16;
+            p[10] = rtp_ssrc >> 8;
+            p[11] = rtp_ssrc;
+            rtp_seq++;
+            p += RTP_HDR_LEN;
+        }
+        int n_ts = 0;
+        for (; n_ts < ts_per_udp && k < r.n_ts; n_ts++, k++, p += TS_LEN) {
+            memcpy(p, r.ts + k * TS_LEN, TS_LEN);
+            if (n_pass == 0)
+                continue;
+            TSHDR_t* h = (TSHDR_t*)p;
+            int pid = get_pid(h);
+            h->cc = (h->cc + n_pass * r.cc_step[pid]) & 15;
+            unsigned long long int pcr;
+            if (get_pcr(p, &pcr))
+                set_pcr(p, (pcr + (unsigned long long int)(n_pass * r.loop_t)) % PCR_WRAP);
+        }
+        iovs[n_batch].iov_base = d;
+        iovs[n_batch].iov_len = p - d;
+        msgs[n_batch].msg_hdr.msg_iov = &iovs[n_batch];
+        msgs[n_batch].msg_hdr.msg_iovlen = 1;
+        msgs[n_batch].msg_hdr.msg_name = &dst;
+        msgs[n_batch].msg_hdr.msg_namelen = sizeof(dst);
+        if (++n_batch == REPLAY_BATCH) {
+            n_sent += replay_send(fd, msgs, n_batch, &n_dropped);
+            n_batch = 0;
+        }
+    }
+    if (n_batch > 0)
+        n_sent += replay_send(fd, msgs, n_batch, &n_dropped);
+
+    printf("replay: %llu datagrams sent, %llu dropped\n", n_sent, n_dropped);
+    free(bufs);
+    close(fd);
+    return 0;
+}
+
+#endif // _WIN32
+
+//=======================================
+// Network impairment stage
+//
+// Between receive and patch, drops (with bursts), duplicates, reorders
+// and delays datagrams according to a profile such as
+//   seed=1,drop=0.01,burst=3,dup=0.005,reorder=0.01,delay=20,jitter=5
+// (probabilities, burst length in datagrams, delay and jitter in ms).
+// All decisions come from a seeded xorshift generator drawn in a fixed
+// order per datagram, so the same input gives the same impairments.
+// Held datagrams wait in a preallocated pool, in a min-heap on their due
+// time or, for reordered ones, in a FIFO until a later datagram has gone
+// out; without -I the receive loop only tests ImpairProfile.
+
+#define IMPAIR_SLOTS    1024
+
+typedef struct {
+    double drop, dup, reorder;
+    int burst;
+    double delay_ms, jitter_ms;
+    unsigned long long int rng;
+
+    int burst_left;
+    unsigned long long int n_in;    // datagrams entered
+    unsigned long long int out_next;    // highest sequence released + 1
+    struct {
+        int len;
+        unsigned long long int seq;
+        unsigned long long int due_ns;
+        unsigned long long int order;
+        unsigned char buf[MSGBUFSIZE];
+    } slot[IMPAIR_SLOTS];
+    int free_slot[IMPAIR_SLOTS], n_free;
+    int heap[IMPAIR_SLOTS], n_heap;     // by due time, then hold order
+    int wait[IMPAIR_SLOTS], wait_head, n_wait;  // reordered, by sequence
+
+    unsigned long long int count_dropped;
+    unsigned long long int count_duplicated;
+    unsigned long long int count_reordered;
+    unsigned long long int count_delayed;
+    unsigned long long int count_overflow;
+} Impair_t;
+
+Impair_t* Impair = NULL;
+
+double impair_rand(void)
+{
+    unsigned long long int x = Impair->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    Impair->rng = x;
+    return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int impair_init(void)
+{
+    Impair = (Impair_t*)calloc(1, sizeof(Impair_t));
+    if (Impair == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    Impair->rng = 1;
+    Impair->burst = 1;
+    for (int i = 0; i < IMPAIR_SLOTS; i++)
+        Impair->free_slot[i] = i;
+    Impair->n_free = IMPAIR_SLOTS;
+
+    char* profile = strdup(ImpairProfile);
+    for (char* tok = strtok(profile, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        char* eq = strchr(tok, '=');
+        if (eq == NULL) {
+            printf("impair: bad item %s\n", tok);
+            free(profile);
+            return 1;
+        }
+        *eq++ = 0;
+        if (!strcmp(tok, "seed"))
+            Impair->rng = strtoull(eq, NULL, 0) | 1;
+        else if (!strcmp(tok, "drop"))
+            Impair->drop = atof(eq);
+        else if (!strcmp(tok, "burst"))
+            Impair->burst = atoi(eq) > 0 ? atoi(eq) : 1;
+        else if (!strcmp(tok, "dup"))
+            Impair->dup = atof(eq);
+        else if (!strcmp(tok, "reorder"))
+            Impair->reorder = atof(eq);
+        else if (!strcmp(tok, "delay"))
+            Impair->delay_ms = atof(eq);
+        else if (!strcmp(tok, "jitter"))
+            Impair->jitter_ms = atof(eq);
+        else {
+            printf("impair: unknown item %s\n", tok);
+            free(profile);
+            return 1;
+        }
+    }
+    free(profile);
+
+    printf("Impair: drop %g (burst %d), dup %g, reorder %g, delay %g ms + %g ms jitter\n",
+        Impair->drop, Impair->burst, Impair->dup, Impair->reorder, Impair->delay_ms, Impair->jitter_ms);
+
+#ifndef _WIN32
+    // held datagrams are released from the receive loop, wake it up
+    input_timeout(1000);
+#endif
+    return 0;
+}
+
+// heap order: due first, then the order datagrams were held in
+int impair_before(int a, int b)
+{
+    return Impair->slot[a].due_ns < Impair->slot[b].due_ns
+        || (Impair->slot[a].due_ns == Impair->slot[b].due_ns && Impair->slot[a].order < Impair->slot[b].order);
+}
+
+void impair_heap_push(int i)
+{
+    int* heap = Impair->heap;
+    int k = Impair->n_heap++;
+    for (; k > 0 && impair_before(i, heap[(k - 1) / 2]); k = (k - 1) / 2)
+        heap[k] = heap[(k - 1) / 2];
+    heap[k] = i;
+}
+
+int impair_heap_pop(void)
+{
+    int* heap = Impair->heap;
+    int top = heap[0];
+    int last = heap[--Impair->n_heap];
+    int k = 0, n = Impair->n_heap;
+    for (int c; (c = 2 * k + 1) < n; k = c) {
+        if (c + 1 < n && impair_before(heap[c + 1], heap[c]))
+            c++;
+        if (!impair_before(heap[c], last))
+            break;
+        heap[k] = heap[c];
+    }
+    heap[k] = last;
+    return top;
+}
+
+int impair_hold(unsigned char* buf, int len, unsigned long long int seq, unsigned long long int due_ns, int reorder)
+{
+    static unsigned long long int order = 0;
+    if (Impair->n_free == 0) {
+        Impair->count_overflow++;
+        return 1;
+    }
+    int i = Impair->free_slot[--Impair->n_free];
+    memcpy(Impair->slot[i].buf, buf, len);
+    Impair->slot[i].len = len;
+    Impair->slot[i].seq = seq;
+    Impair->slot[i].due_ns = due_ns;
+    Impair->slot[i].order = order++;
+
+    // sequences only grow, so waiting ones stay sorted
+    if (reorder)
+        Impair->wait[(Impair->wait_head + Impair->n_wait++) % IMPAIR_SLOTS] = i;
+    else
+        impair_heap_push(i);
+    return 0;
+}
+
+// seq went out: reordered datagrams before it may follow once due
+void impair_release(unsigned long long int seq)
+{
+    if (seq + 1 > Impair->out_next)
+        Impair->out_next = seq + 1;
+    while (Impair->n_wait > 0) {
+        int i = Impair->wait[Impair->wait_head];
+        if (Impair->out_next <= Impair->slot[i].seq + 1)
+            break;
+        Impair->wait_head = (Impair->wait_head + 1) % IMPAIR_SLOTS;
+        Impair->n_wait--;
+        impair_heap_push(i);
+    }
+}
+
+// a received datagram enters the stage: length to process it now,
+// -1 if dropped or held for later
+int impair_push(unsigned char* buf, int len)
+{
+    unsigned long long int now = (unsigned long long int)(wall_time() * 1e9);
+    unsigned long long int seq = Impair->n_in++;
+
+    // always draw the same numbers, whatever the outcome
+    double r_drop = impair_rand(), r_dup = impair_rand(), r_reorder = impair_rand(), r_jitter = impair_rand();
+
+    if (Impair->burst_left > 0 || r_drop < Impair->drop) {
+        if (Impair->burst_left == 0)
+            Impair->burst_left = Impair->burst;
+        Impair->burst_left--;
+        Impair->count_dropped++;
+        return -1;
+    }
+
+    unsigned long long int due = now + (unsigned long long int)((Impair->delay_ms + r_jitter * Impair->jitter_ms) * 1e6);
+    int reorder = r_reorder < Impair->reorder;
+    if (reorder)
+        Impair->count_reordered++;
+    if (r_dup < Impair->dup && impair_hold(buf, len, seq, due, 0) == 0)
+        Impair->count_duplicated++;
+
+    if (due <= now && !reorder) {
+        impair_release(seq);
+        return len;
+    }
+    if (due > now)
+        Impair->count_delayed++;
+    if (impair_hold(buf, len, seq, due, reorder)) {
+        impair_release(seq);
+        return len;         // pool full: pass through
+    }
+    return -1;
+}
+
+// due time of the next held datagram, 0 if none
+unsigned long long int impair_next_due(void)
+{
+    if (Impair == NULL || Impair->n_heap == 0)
+        return 0;
+    unsigned long long int due = Impair->slot[Impair->heap[0]].due_ns;
+    return due != 0 ? due : 1;
+}
+
+// next held datagram due, copied to buf, -1 if none
+int impair_pop(unsigned char* buf)
+{
+    if (Impair->n_heap == 0)
+        return -1;
+    unsigned long long int now = (unsigned long long int)(wall_time() * 1e9);
+    if (Impair->slot[Impair->heap[0]].due_ns > now)
+        return -1;
+    int i = impair_heap_pop();
+    int len = Impair->slot[i].len;
+    memcpy(buf, Impair->slot[i].buf, len);
+    Impair->free_slot[Impair->n_free++] = i;
+    impair_release(Impair->slot[i].seq);
+    return len;
+}
+
+// hot restart: whatever is held goes out now, in the order it was held
+void impair_flush(void)
+{
+    int held[IMPAIR_SLOTS];
+    int n = 0;
+    while (Impair->n_heap > 0)
+        held[n++] = impair_heap_pop();
+    for (; Impair->n_wait > 0; Impair->n_wait--) {
+        held[n++] = Impair->wait[Impair->wait_head];
+        Impair->wait_head = (Impair->wait_head + 1) % IMPAIR_SLOTS;
+    }
+    for (int k = 0; k < n; k++) {
+        Impair->slot[held[k]].due_ns = 0;
+        impair_heap_push(held[k]);
+    }
+}
+
+void impair_print(void)
+{
+    printf("\n  impair   %8llu dropped %8llu duplicated %8llu reordered %8llu delayed %8llu overflow",
+        Impair->count_dropped, Impair->count_duplicated, Impair->count_reordered,
+        Impair->count_delayed, Impair->count_overflow);
+}
+
+//=======================================
+// PCR jitter and accuracy (Linux only)
+//
+// With -J the input socket gets kernel receive timestamps
+// (SO_TIMESTAMPNS) and, for each PCR PID, four fixed histograms are
+// kept: PCR interval, PCR accuracy (PCR against the position of its
+// packet at the rate of the previous interval, constant rate assumed)
+// and overall jitter at input and output. The jitter is the receive
+// (or send) time minus the PCR, relative to its lowest value over the
+// last two JIT_WINDOW periods, which absorbs the clock drift between
+// the head end and us. Input jitter is what the network delivered,
+// output jitter adds the filter path, so the difference is what the
+// filter adds. Datagrams released by the impairment stage (-I) are
+// stamped at release: impairment counts as network jitter.
+//
+// PCRs are picked before the patch, so hidden PCR PIDs are measured
+// too, and accounted once the datagram is sent.
+
+#ifndef _WIN32
+
+#define JIT_MAX_PIDS        16
+#define JIT_WINDOW          5.0     // s
+#define JIT_INTERVAL_BINS   51      // 2 ms, last one for 100 ms and more
+#define JIT_ACCURACY_BINS   21      // 50 ns of |error|, last one for 1 us and more
+#define JIT_JITTER_BINS     25      // < 1 us, then [2^(k-1), 2^k) us
+
+typedef struct {
+    int pid;
+    unsigned long long int count;
+    unsigned long long int pcr;         // last PCR, 27 MHz
+    unsigned long long int pcr_ext;     // unwrapped
+    unsigned long long int pos;         // packet index of the last PCR
+    double ticks_per_packet;            // 0 if unknown
+    long long int min_in[2];            // offset minimum, current and previous window
+    long long int min_out[2];
+    double window_start;
+    unsigned long long int interval[JIT_INTERVAL_BINS];
+    unsigned long long int accuracy[JIT_ACCURACY_BINS];
+    unsigned long long int jitter_in[JIT_JITTER_BINS];
+    unsigned long long int jitter_out[JIT_JITTER_BINS];
+} PcrJitter_t;
+
+// PCR found in the datagram being processed
+typedef struct {
+    int pid;
+    int discontinuity;
+    unsigned long long int pcr;
+    unsigned long long int pos;
+} PcrHit_t;
+
+PcrJitter_t JitPids[JIT_MAX_PIDS];
+int jit_n_pids = 0;
+unsigned long long int jit_pos = 0;     // packets scanned
+
+int jitter_init(void)
+{
+    int on = 1;
+    if (setsockopt(fd_in, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        perror("SO_TIMESTAMPNS");
+        return 1;
+    }
+    printf("Jitter: PCR interval, accuracy and jitter against kernel receive time\n");
+    return 0;
+}
+
+unsigned long long int realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// recvfrom() returning the kernel receive time, or now if there is none
+int recv_stamped(int fd, unsigned char* buf, int len, int flags, unsigned long long int* rx_ns)
+{
+    struct iovec iov = { buf, (size_t)len };
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int n = recvmsg(fd, &msg, flags);
+    if (n < 0)
+        return n;
+    *rx_ns = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            *rx_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    if (*rx_ns == 0)
+        *rx_ns = realtime_ns();
+    return n;
+}
+
+// one input datagram for -J and -C: with the kernel receive time, and
+// with only the read of a datagram already queued accounted, never the
+// wait for it
+int recv_input(unsigned char* buf, unsigned long long int* rx_ns)
+{
+    if (CycleAccounting) {
+        struct pollfd p = { fd_in, POLLIN, 0 };
+        int rc = poll(&p, 1, InputTimeoutUs > 0 ? (InputTimeoutUs + 999) / 1000 : -1);
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = EAGAIN;     // as SO_RCVTIMEO
+            return -1;
+        }
+    }
+    int flags = CycleAccounting ? MSG_DONTWAIT : 0;
+    unsigned long long int t0 = read_tsc();
+    int n = PcrJitter ? recv_stamped(fd_in, buf, MSGBUFSIZE, flags, rx_ns)
+        : (int)recv(fd_in, (char*)buf, MSGBUFSIZE, flags);
+    if (n >= 0 && CycleAccounting) {
+        CycleStats.cycles[STAGE_RECEIVE] += read_tsc() - t0;
+        ++CycleStats.count[STAGE_RECEIVE];
+    }
+    return n;
+}
+
+// PCRs of a datagram, before it is patched
+int jitter_scan(unsigned char* ts_buf, int n_ts, PcrHit_t* hits)
+{
+    int n = 0;
+    for (int i = 0; i < n_ts; i++, jit_pos++) {
+        unsigned char* ts = ts_buf + i * TS_LEN;
+        if (check_sync((TSHDR_t*)ts) && get_pcr(ts, &hits[n].pcr)) {
+            hits[n].pid = get_pid((TSHDR_t*)ts);
+            hits[n].discontinuity = (ts[5] & 0x80) != 0;
+            hits[n].pos = jit_pos;
+            n++;
+        }
+    }
+    return n;
+}
+
+int jitter_bin(long long int us)
+{
+    int bin = 0;
+    while (us > 0 && bin < JIT_JITTER_BINS - 1) {
+        us >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+void jitter_offset(unsigned long long int* hist, long long int* min, long long int offset)
+{
+    if (offset < min[0])
+        min[0] = offset;
+    long long int low = min[0] < min[1] ? min[0] : min[1];
+    hist[jitter_bin((offset - low) / 1000)]++;
+}
+
+void jitter_account(PcrHit_t* hits, int n_hits, unsigned long long int rx_ns, unsigned long long int tx_ns)
+{
+    for (int h = 0; h < n_hits; h++) {
+        PcrJitter_t* j = NULL;
+        for (int i = 0; i < jit_n_pids && j == NULL; i++)
+            if (JitPids[i].pid == hits[h].pid)
+                j = &JitPids[i];
+        if (j == NULL) {
+            if (jit_n_pids == JIT_MAX_PIDS)
+                continue;
+            j = &JitPids[jit_n_pids++];
+            memset(j, 0, sizeof(*j));
+            j->pid = hits[h].pid;
+        }
+
+        unsigned long long int delta = (hits[h].pcr + PCR_WRAP - j->pcr) % PCR_WRAP;
+        double now = rx_ns / 1e9;
+        if (j->count == 0 || hits[h].discontinuity || delta > PCR_HZ) {
+            // first PCR or time base change: restart from here
+            j->pcr_ext = hits[h].pcr;
+            j->ticks_per_packet = 0;
+            j->min_in[0] = j->min_in[1] = j->min_out[0] = j->min_out[1] = 0x7FFFFFFFFFFFFFFFLL;
+            j->window_start = now;
+        }
+        else {
+            j->pcr_ext += delta;
+            int bin = (int)(delta * 500 / PCR_HZ);     // 2 ms bins
+            j->interval[bin < JIT_INTERVAL_BINS ? bin : JIT_INTERVAL_BINS - 1]++;
+            unsigned long long int packets = hits[h].pos - j->pos;
+            if (j->ticks_per_packet > 0) {
+                double err_ns = ((double)delta - packets * j->ticks_per_packet) * 1e9 / PCR_HZ;
+                bin = (int)((err_ns < 0 ? -err_ns : err_ns) / 50);
+                j->accuracy[bin < JIT_ACCURACY_BINS ? bin : JIT_ACCURACY_BINS - 1]++;
+            }
+            j->ticks_per_packet = packets ? (double)delta / packets : 0;
+        }
+        j->pcr = hits[h].pcr;
+        j->pos = hits[h].pos;
+        j->count++;
+
+        if (now - j->window_start > JIT_WINDOW) {
+            j->min_in[1] = j->min_in[0];
+            j->min_out[1] = j->min_out[0];
+            j->min_in[0] = j->min_out[0] = 0x7FFFFFFFFFFFFFFFLL;
+            j->window_start = now;
+        }
+        long long int pcr_ns = (long long int)(j->pcr_ext / 27 * 1000 + j->pcr_ext % 27 * 1000 / 27);
+        jitter_offset(j->jitter_in, j->min_in, (long long int)rx_ns - pcr_ns);
+        jitter_offset(j->jitter_out, j->min_out, (long long int)tx_ns - pcr_ns);
+    }
+}
+
+// bin reaching fraction q of the samples
+int hist_quantile(unsigned long long int* hist, int n_bins, double q)
+{
+    unsigned long long int total = 0, sum = 0;
+    for (int i = 0; i < n_bins; i++)
+        total += hist[i];
+    for (int i = 0; i < n_bins; i++) {
+        sum += hist[i];
+        if (total > 0 && sum >= q * total)
+            return i;
+    }
+    return n_bins - 1;
+}
+
+void jitter_print(void)
+{
+    printf("\n");
+    for (int i = 0; i < jit_n_pids; i++) {
+        PcrJitter_t* j = &JitPids[i];
+        int iv50 = hist_quantile(j->interval, JIT_INTERVAL_BINS, 0.5);
+        int iv99 = hist_quantile(j->interval, JIT_INTERVAL_BINS, 0.99);
+        int ac99 = hist_quantile(j->accuracy, JIT_ACCURACY_BINS, 0.99);
+        int in99 = hist_quantile(j->jitter_in, JIT_JITTER_BINS, 0.99);
+        int out99 = hist_quantile(j->jitter_out, JIT_JITTER_BINS, 0.99);
+        printf("  PCR PID %4d %10llu PCRs, interval p50 < %d ms p99 < %d ms, accuracy p99 < %d ns,"
+            " jitter p99 in < %lld us out < %lld us\n", j->pid, j->count, (iv50 + 1) * 2, (iv99 + 1) * 2,
+            (ac99 + 1) * 50, 1LL << in99, 1LL << out99);
+    }
+}
+
+#endif // _WIN32
+
+//=======================================
+// Sampled monitor output (Linux only)
+//
+// -m mcast:port:n sends every nth output datagram to a second group,
+// -m mcast:port:psi only the PSI (PID < 0x20 and PMTs from the PAT)
+// and PCR-bearing packets of each output datagram, as plain UDP without
+// the RTP header. Both send from msgbuf through the output socket: the
+// whole datagram, or an iovec per selected packet, without copy.
+
+#ifndef _WIN32
+
+typedef struct {
+    Addr_t addr;
+    int every;                  // 0: PSI and PCR packets
+    int pat_version;            // of the PAT the PMT PIDs come from, -1 none
+    unsigned char pmt[PID_COUNT];
+    unsigned long long int count_seen;
+    unsigned long long int count_sent;
+    unsigned long long int bytes_seen;
+    unsigned long long int bytes_sent;
+} Monitor_t;
+
+Monitor_t Monitor;
+
+int monitor_init(void)
+{
+    // from the right, an IPv6 group has colons of its own
+    char spec[80];
+    snprintf(spec, sizeof(spec), "%s", MonitorSpec);
+    char* mode = strrchr(spec, ':');
+    char* port = NULL;
+    if (mode != NULL) {
+        *mode++ = 0;
+        port = strrchr(spec, ':');
+    }
+    if (port == NULL) {
+        printf("monitor: need mcast:port:n or mcast:port:psi\n");
+        return 1;
+    }
+    *port++ = 0;
+    memset(&Monitor, 0, sizeof(Monitor));
+    Monitor.pat_version = -1;
+    if (addr_parse(&Monitor.addr, spec, atoi(port)))
+        return 1;
+    if (Monitor.addr.sa.sa_family != addr_out.sa.sa_family) {
+        printf("monitor: %s must be of the output's address family\n", spec);
+        return 1;
+    }
+    Monitor.every = strcmp(mode, "psi") ? atoi(mode) : 0;
+    if (strcmp(mode, "psi") && Monitor.every <= 0) {
+        printf("monitor: bad mode %s\n", mode);
+        return 1;
+    }
+    if (Monitor.every > 0)
+        printf("Monit : %s : %s, 1 datagram out of %d\n", spec, port, Monitor.every);
+    else
+        printf("Monit : %s : %s, PSI and PCR packets\n", spec, port);
+    return 0;
+}
+
+// PAT in this packet: remember its PMT PIDs, forget those of an older
+// PAT version
+void monitor_pat(unsigned char* ts)
+{
+    TSHDR_t* h = (TSHDR_t*)ts;
+    int p = 4 + (h->afc & 2 ? 1 + ts[4] : 0);
+    if (!h->pusi || !(h->afc & 1) || p >= TS_LEN)
+        return;
+    p += 1 + ts[p];
+    if (p + 8 > TS_LEN || ts[p] != 0x00 || !(ts[p + 5] & 0x01))
+        return;
+    int version = (ts[p + 5] >> 1) & 0x1F;
+    if (version != Monitor.pat_version) {
+        memset(Monitor.pmt, 0, sizeof(Monitor.pmt));
+        Monitor.pat_version = version;
+    }
+    int end = p + 3 + (((ts[p + 1] & 0x0F) << 8) | ts[p + 2]) - 4;
+    for (int i = p + 8; i + 4 <= end && i + 4 <= TS_LEN; i += 4)
+        if ((ts[i] << 8 | ts[i + 1]) != 0)
+            Monitor.pmt[((ts[i + 2] & 0x1F) << 8) | ts[i + 3]] = 1;
+}
+
+void monitor_send(unsigned char* buf, int n_in, int ts_offset, int n_ts)
+{
+    Monitor.count_seen++;
+    Monitor.bytes_seen += n_in;
+    struct iovec iov[MSGBUFSIZE / TS_LEN];
+    int n_iov = 0;
+    if (Monitor.every > 0) {
+        if (Monitor.count_seen % Monitor.every)
+            return;
+        iov[n_iov].iov_base = buf;
+        iov[n_iov++].iov_len = n_in;
+    }
+    else {
+        for (int i = 0; i < n_ts; i++) {
+            unsigned char* ts = buf + ts_offset + i * TS_LEN;
+            unsigned int pid = get_pid((TSHDR_t*)ts);
+            unsigned long long int pcr;
+            if (pid == PID_NULL)
+                continue;       // hidden, PCR or PMT included
+            if (pid == 0)
+                monitor_pat(ts);
+            if (pid < 0x20 || Monitor.pmt[pid] || get_pcr(ts, &pcr)) {
+                iov[n_iov].iov_base = ts;
+                iov[n_iov++].iov_len = TS_LEN;
+            }
+        }
+        if (n_iov == 0)
+            return;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &Monitor.addr;
+    msg.msg_namelen = addr_len(&Monitor.addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    int n = sendmsg(fd_out, &msg, 0);
+    if (n < 0) {
+        perror("monitor sendmsg");
+        return;
+    }
+    Monitor.count_sent++;
+    Monitor.bytes_sent += n;
+}
+
+void monitor_print(void)
+{
+    printf("\n  monitor %10llu datagrams sent, %.2f %% of output bytes\n", Monitor.count_sent,
+        Monitor.bytes_seen ? 100.0 * Monitor.bytes_sent / Monitor.bytes_seen : 0.0);
+}
+
+#endif // _WIN32
+
+//=======================================
+// Non-blocking output with a bounded send queue (-Q, Linux only)
+//
+// -Q n[:head|tail][:ms] never lets a slow output stall the receive
+// side. Each output (main and redundant) sends with MSG_DONTWAIT; a
+// datagram its socket buffer cannot take waits in a ring of n
+// datagrams, copied since msgbuf is reused by the next receive. A full
+// ring drops the oldest datagram (head, default) or the new one
+// (tail). With ms, a datagram still queued that long after it was
+// received is dropped as late instead of sent. While anything is
+// queued the loop waits in epoll for the input to be readable or an
+// output writable rather than in recvfrom, so EAGAIN is retried as
+// soon as there is room; an output is polled for room only while its
+// ring holds something. Without -Q the send path is unchanged.
+
+#ifndef _WIN32
+
+typedef struct {
+    int fd;
+    const Addr_t* addr;
+    const char* name;
+    unsigned char (*buf)[MSGBUFSIZE];
+    int* len;
+    unsigned long long int* t_ns;       // queued at, about the receive time
+    int head, n;
+    int n_max;
+    int armed;                          // EPOLLOUT registered
+    unsigned long long int count_queued, count_dropped, count_late, count_err;
+} SendQueue_t;
+
+SendQueue_t Queues[1 + OUTPUT_MAX];
+int n_queues = 0;
+
+// epoll set of the receive loop, input first, see loop_wait()
+#define LOOP_INPUT  0xFFFFFFFF
+int loop_epfd = -1;
+
+int loop_epoll(void)
+{
+    if (loop_epfd >= 0)
+        return 0;
+    loop_epfd = epoll_create1(0);
+    if (loop_epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = LOOP_INPUT;
+    if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd_in, &ev) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    return 0;
+}
+
+int queue_init(void)
+{
+    if (loop_epoll())
+        return 1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+
+    n_queues = 1 + OutputCount;
+    for (int i = 0; i < n_queues; i++)
+    {
+        SendQueue_t* q = &Queues[i];
+        memset(q, 0, sizeof(*q));
+        q->fd = i == 0 ? fd_out : Outputs[i - 1].fd;
+        q->addr = i == 0 ? &addr_out : &Outputs[i - 1].addr;
+        q->name = i == 0 ? "main" : Outputs[i - 1].iface;
+        q->buf = (unsigned char(*)[MSGBUFSIZE])malloc((size_t)SendQueueLen * MSGBUFSIZE);
+        q->len = (int*)malloc(SendQueueLen * sizeof(int));
+        q->t_ns = (unsigned long long int*)malloc(SendQueueLen * sizeof(unsigned long long int));
+        if (q->buf == NULL || q->len == NULL || q->t_ns == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        ev.events = 0;                  // armed by queue_arm() while the ring is not empty
+        ev.data.u32 = i;
+        if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, q->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return 1;
+        }
+    }
+    printf("Queue : %d datagrams per output, %s drop, %s\n", SendQueueLen,
+        SendQueueDropHead ? "head" : "tail", SendQueueLateMs > 0 ? "latency bound" : "no latency bound");
+    return 0;
+}
+
+// 0 sent, 1 the socket buffer is full, -1 lost (not retried)
+int queue_try(SendQueue_t* q, unsigned char* buf, int len)
+{
+    int n = sendto(q->fd, (char*)buf, len, MSG_DONTWAIT, &q->addr->sa, addr_len(q->addr));
+    if (n >= 0)
+        return 0;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+    if (q->count_err++ == 0)
+        perror(q->name);
+    return -1;
+}
+
+// wait for room on this output only while something is queued for it,
+// a level-triggered EPOLLOUT on an idle output would wake the loop at once
+void queue_arm(SendQueue_t* q)
+{
+    if ((q->n > 0) == q->armed)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = q->n > 0 ? (unsigned int)EPOLLOUT : 0;
+    ev.data.u32 = (unsigned int)(q - Queues);
+    if (epoll_ctl(loop_epfd, EPOLL_CTL_MOD, q->fd, &ev) < 0)
+        perror("epoll_ctl");
+    else
+        q->armed = q->n > 0;
+}
+
+// send what is queued, oldest first, until the socket buffer fills up
+void queue_flush(SendQueue_t* q, unsigned long long int now)
+{
+    unsigned long long int late = (unsigned long long int)SendQueueLateMs * 1000000;
+    while (q->n > 0)
+    {
+        if (late > 0 && now - q->t_ns[q->head] > late)
+            q->count_late++;
+        else if (queue_try(q, q->buf[q->head], q->len[q->head]) == 1)
+            return;
+        q->head = (q->head + 1) % SendQueueLen;
+        q->n--;
+    }
+}
+
+// len sent now, 0 queued, -1 lost or dropped
+int queue_send(SendQueue_t* q, unsigned char* buf, int len)
+{
+    unsigned long long int now = mono_ns();
+    queue_flush(q, now);
+    if (q->n == 0) {
+        int r = queue_try(q, buf, len);
+        if (r <= 0)
+            return r == 0 ? len : -1;
+    }
+
+    if (q->n == SendQueueLen) {
+        q->count_dropped++;
+        if (!SendQueueDropHead)
+            return -1;
+        q->head = (q->head + 1) % SendQueueLen;
+        q->n--;
+    }
+    int tail = (q->head + q->n) % SendQueueLen;
+    memcpy(q->buf[tail], buf, len);
+    q->len[tail] = len;
+    q->t_ns[tail] = now;
+    q->n++;
+    q->count_queued++;
+    if (q->n > q->n_max)
+        q->n_max = q->n;
+    return 0;
+}
+
+// hot restart: send what is queued, for up to a second
+void queue_drain(void)
+{
+    unsigned long long int until = mono_ns() + 1000000000ULL;
+    for (;;)
+    {
+        unsigned long long int now = mono_ns();
+        struct pollfd pfd[1 + OUTPUT_MAX];
+        int n = 0;
+        for (int i = 0; i < n_queues; i++) {
+            queue_flush(&Queues[i], now);
+            if (Queues[i].n > 0) {
+                pfd[n].fd = Queues[i].fd;
+                pfd[n].events = POLLOUT;
+                n++;
+            }
+        }
+        if (n == 0)
+            return;
+        if (now >= until)
+            break;
+        poll(pfd, n, 10);
+    }
+    for (int i = 0; i < n_queues; i++)
+        if (Queues[i].n > 0) {
+            printf("handoff: %d datagrams still queued for %s, dropped\n", Queues[i].n, Queues[i].name);
+            Queues[i].count_dropped += Queues[i].n;
+        }
+}
+
+void queue_print(void)
+{
+    for (int i = 0; i < n_queues; i++) {
+        SendQueue_t* q = &Queues[i];
+        printf("\n  queue %-8s %4d now, %4d max, %10llu queued, %8llu dropped, %8llu late, %llu errors\n",
+            q->name, q->n, q->n_max, q->count_queued, q->count_dropped, q->count_late, q->count_err);
+    }
+}
+
+#endif // _WIN32
+
+//=======================================
+// Stage pipeline on epoll (Linux only)
+//
+// Stages that hold datagrams (reorder, FEC, pacing) chain between the
+// receive and the parse, patch and send steps of the loop. Each stage
+// gets a frame in push() and passes it on with stage_out(), keeps it,
+// or frees it; a stage that needs to be resumed later sets wake_ns and
+// its wake() runs at that time. Frames leaving the last stage queue up
+// and the loop takes them with pipe_pop() before receiving again, as
+// for the impairment stage. Frames and stage state come from one arena
+// allocated at start, so a stage adds neither threads nor allocations
+// per datagram. loop_wait() is the event loop: before a blocking
+// receive it runs stage timers and send queues in epoll until the input
+// is readable or frames are ready. Without stages and -Q the loop
+// receives as before.
+//
+// -reorder n[:ms] puts RTP datagrams back in sequence order, holding at
+// most n and none longer than ms (20) before giving up on a gap.
+
+#ifndef _WIN32
+
+#define PIPE_FRAMES         1024
+#define PIPE_MAX_STAGES     8
+#define PIPE_ARENA_STATE    (256 * 1024)    // stage state
+
+typedef struct Frame_s {
+    struct Frame_s* next;       // free list, ready list or stage list
+    int len;
+    unsigned long long int t_ns;    // entered the pipeline
+    unsigned long long int rx_ns;   // received, wall clock for -J, 0: not taken
+    unsigned char buf[MSGBUFSIZE];
+} Frame_t;
+
+typedef struct Stage_s {
+    const char* name;
+    void (*push)(struct Stage_s* s, Frame_t* f);
+    void (*wake)(struct Stage_s* s, unsigned long long int now);
+    void (*print)(struct Stage_s* s);
+    void (*flush)(struct Stage_s* s);      // hot restart: pass on what is held
+    void* state;
+    unsigned long long int wake_ns;     // 0: not waiting
+    struct Stage_s* next;               // NULL: ready for the loop
+    unsigned long long int count_in, count_out;
+} Stage_t;
+
+typedef struct {
+    unsigned char* arena;
+    size_t arena_used, arena_size;
+    Frame_t* free;
+    Frame_t* ready;             // oldest first
+    Frame_t* ready_tail;
+    Stage_t stages[PIPE_MAX_STAGES];
+    int n_stages;
+    unsigned long long int count_overflow;
+} Pipeline_t;
+
+Pipeline_t Pipe;
+
+void* pipe_alloc(size_t size)
+{
+    size = (size + 63) & ~(size_t)63;
+    if (Pipe.arena_used + size > Pipe.arena_size)
+        return NULL;
+    void* p = Pipe.arena + Pipe.arena_used;
+    Pipe.arena_used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void frame_free(Frame_t* f)
+{
+    f->next = Pipe.free;
+    Pipe.free = f;
+}
+
+void stage_out(Stage_t* s, Frame_t* f)
+{
+    s->count_out++;
+    if (s->next != NULL) {
+        s->next->count_in++;
+        s->next->push(s->next, f);
+        return;
+    }
+    f->next = NULL;
+    if (Pipe.ready == NULL)
+        Pipe.ready = f;
+    else
+        Pipe.ready_tail->next = f;
+    Pipe.ready_tail = f;
+}
+
+Stage_t* pipe_stage(const char* name)
+{
+    if (Pipe.n_stages == PIPE_MAX_STAGES)
+        return NULL;
+    Stage_t* s = &Pipe.stages[Pipe.n_stages];
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    if (Pipe.n_stages > 0)
+        Pipe.stages[Pipe.n_stages - 1].next = s;
+    Pipe.n_stages++;
+    return s;
+}
+
+// a received datagram enters the first stage
+void pipe_push(unsigned char* buf, int len, unsigned long long int rx_ns)
+{
+    Frame_t* f = Pipe.free;
+    if (f == NULL) {
+        Pipe.count_overflow++;
+        return;
+    }
+    Pipe.free = f->next;
+    memcpy(f->buf, buf, len);
+    f->len = len;
+    f->t_ns = mono_ns();
+    f->rx_ns = rx_ns;
+    Pipe.stages[0].count_in++;
+    Pipe.stages[0].push(&Pipe.stages[0], f);
+}
+
+// next datagram out of the last stage, copied to buf with its receive
+// time, -1 if none
+int pipe_pop(unsigned char* buf, unsigned long long int* rx_ns)
+{
+    Frame_t* f = Pipe.ready;
+    if (f == NULL)
+        return -1;
+    int len = f->len;
+    Pipe.ready = f->next;
+    memcpy(buf, f->buf, len);
+    *rx_ns = f->rx_ns;
+    frame_free(f);
+    return len;
+}
+
+// hot restart: each stage passes on what it holds, 1 if frames are ready
+int pipe_flush(void)
+{
+    for (int i = 0; i < Pipe.n_stages; i++)
+        if (Pipe.stages[i].flush != NULL)
+            Pipe.stages[i].flush(&Pipe.stages[i]);
+    return Pipe.ready != NULL;
+}
+
+// before a blocking receive: run stage timers and send queues until the
+// input is readable, 1 if frames are ready or an impaired datagram is
+// due instead
+int loop_wait(void)
+{
+    for (;;)
+    {
+        unsigned long long int now = mono_ns();
+        unsigned long long int deadline = 0;
+        int pending = 0;
+
+        for (int i = 0; i < Pipe.n_stages; i++) {
+            Stage_t* s = &Pipe.stages[i];
+            if (s->wake_ns != 0 && s->wake_ns <= now) {
+                s->wake_ns = 0;
+                s->wake(s, now);
+            }
+        }
+        if (Pipe.ready != NULL)
+            return 1;
+        for (int i = 0; i < Pipe.n_stages; i++)
+            if (Pipe.stages[i].wake_ns != 0 && (deadline == 0 || Pipe.stages[i].wake_ns < deadline))
+                deadline = Pipe.stages[i].wake_ns;
+
+        // datagrams held by -I go through the stages when due, before
+        // a stage gives up waiting for them
+        unsigned long long int due = impair_next_due();
+        if (due != 0 && due <= now)
+            return 1;
+        if (due != 0 && (deadline == 0 || due < deadline))
+            deadline = due;
+        pending = deadline != 0;
+
+        // send queues wait for room, late datagrams expire
+        for (int i = 0; i < n_queues; i++) {
+            SendQueue_t* q = &Queues[i];
+            queue_flush(q, now);
+            queue_arm(q);
+            if (q->n == 0)
+                continue;
+            pending = 1;
+            unsigned long long int expiry = q->t_ns[q->head] + SendQueueLateMs * 1000000ULL + 1;
+            if (SendQueueLateMs > 0 && (deadline == 0 || expiry < deadline))
+                deadline = expiry;
+        }
+        if (!pending)
+            return 0;
+
+        int timeout = -1;
+        if (deadline != 0)
+            timeout = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+        struct epoll_event ev[2 + OUTPUT_MAX];
+        int n = epoll_wait(loop_epfd, ev, 2 + OUTPUT_MAX, timeout);
+        for (int i = 0; i < n; i++)
+            if (ev[i].data.u32 == LOOP_INPUT)
+                return 0;
+    }
+}
+
+//---------------------------------------
+// reorder stage
+
+int ReorderWindow = 0;
+int ReorderMs = 20;
+
+typedef struct {
+    int window;
+    unsigned long long int hold_ns;
+    int started;
+    unsigned short next;        // RTP sequence number expected
+    Frame_t** slot;             // by sequence number & mask
+    int mask;                   // slots - 1, slots a power of two >= window
+    int n_held;
+    unsigned long long int count_reordered, count_lost, count_late;
+} Reorder_t;
+
+#define RTP_SEQ(f)  ((unsigned short)((f)->buf[2] << 8 | (f)->buf[3]))
+
+// pass on the frames held in sequence from next
+void reorder_drain(Stage_t* s, Reorder_t* r)
+{
+    Frame_t* f;
+    while ((f = r->slot[r->next & r->mask]) != NULL && RTP_SEQ(f) == r->next) {
+        r->slot[r->next & r->mask] = NULL;
+        r->n_held--;
+        r->next++;
+        stage_out(s, f);
+    }
+}
+
+// give up on the gap before the held frame with the lowest sequence
+void reorder_skip(Stage_t* s, Reorder_t* r)
+{
+    for (int d = 1; d < r->window; d++) {
+        Frame_t* f = r->slot[(r->next + d) & r->mask];
+        if (f != NULL) {
+            r->count_lost += d;
+            r->next += d;
+            reorder_drain(s, r);
+            return;
+        }
+    }
+}
+
+void reorder_rearm(Stage_t* s, Reorder_t* r)
+{
+    s->wake_ns = 0;
+    for (int i = 0; i <= r->mask && r->n_held > 0; i++)
+        if (r->slot[i] != NULL && (s->wake_ns == 0 || r->slot[i]->t_ns + r->hold_ns < s->wake_ns))
+            s->wake_ns = r->slot[i]->t_ns + r->hold_ns;
+}
+
+void reorder_push(Stage_t* s, Frame_t* f)
+{
+    Reorder_t* r = (Reorder_t*)s->state;
+    int rtp = f->len % TS_LEN == RTP_HDR_LEN && (f->buf[0] >> 6) == 2;
+    if (!rtp) {
+        stage_out(s, f);
+        return;
+    }
+    unsigned short seq = RTP_SEQ(f);
+    if (!r->started) {
+        r->started = 1;
+        r->next = seq;
+    }
+    short ahead = (short)(seq - r->next);
+    Frame_t* held = r->slot[seq & r->mask];
+    if (ahead < 0 || (held != NULL && RTP_SEQ(held) == seq)) {
+        r->count_late++;            // gap already given up on, or a duplicate
+        frame_free(f);
+        return;
+    }
+    while (ahead >= r->window) {
+        // out of the window: the gaps before it will not be filled in time
+        if (r->n_held == 0) {
+            r->count_lost += ahead;
+            r->next = seq;
+            ahead = 0;
+        }
+        else {
+            reorder_skip(s, r);
+            ahead = (short)(seq - r->next);
+        }
+    }
+    if (ahead == 0) {
+        r->next++;
+        stage_out(s, f);
+        reorder_drain(s, r);
+    }
+    else {
+        Frame_t** slot = &r->slot[seq & r->mask];
+        if (*slot != NULL) {
+            // held frames stay within window of next, this one is stale
+            r->count_lost++;
+            r->n_held--;
+            frame_free(*slot);
+        }
+        *slot = f;
+        r->n_held++;
+        r->count_reordered++;
+    }
+    reorder_rearm(s, r);
+}
+
+void reorder_wake(Stage_t* s, unsigned long long int now)
+{
+    Reorder_t* r = (Reorder_t*)s->state;
+    do {
+        reorder_skip(s, r);
+        reorder_rearm(s, r);
+    } while (s->wake_ns != 0 && s->wake_ns <= now);
+}
+
+void reorder_flush(Stage_t* s)
+{
+    Reorder_t* r = (Reorder_t*)s->state;
+    while (r->n_held > 0) {
+        int held = r->n_held;
+        reorder_skip(s, r);     // gives up on the gap before the next held frame
+        if (r->n_held == held)
+            break;
+    }
+    s->wake_ns = 0;
+}
+
+void reorder_print(Stage_t* s)
+{
+    Reorder_t* r = (Reorder_t*)s->state;
+    printf(", %llu out of order, %llu lost, %llu late, %d held", r->count_reordered, r->count_lost,
+        r->count_late, r->n_held);
+}
+
+int reorder_init(void)
+{
+    // a power of two divides 65536: slots follow the sequence number across its wrap
+    int n_slots = 1;
+    while (n_slots < ReorderWindow)
+        n_slots <<= 1;
+    Stage_t* s = pipe_stage("reorder");
+    Reorder_t* r = (Reorder_t*)pipe_alloc(sizeof(Reorder_t));
+    Frame_t** slot = (Frame_t**)pipe_alloc(n_slots * sizeof(Frame_t*));
+    if (s == NULL || r == NULL || slot == NULL) {
+        printf("reorder: pipeline full\n");
+        return 1;
+    }
+    r->window = ReorderWindow;
+    r->hold_ns = ReorderMs * 1000000ULL;
+    r->slot = slot;
+    r->mask = n_slots - 1;
+    s->state = r;
+    s->push = reorder_push;
+    s->wake = reorder_wake;
+    s->print = reorder_print;
+    s->flush = reorder_flush;
+    printf("Stage : reorder RTP, %d datagrams, %d ms\n", ReorderWindow, ReorderMs);
+    return 0;
+}
+
+//---------------------------------------
+
+int pipe_init(void)
+{
+    if (ReorderWindow >= PIPE_FRAMES) {
+        printf("reorder: window up to %d datagrams\n", PIPE_FRAMES - 1);
+        return 1;
+    }
+    Pipe.arena_size = PIPE_FRAMES * sizeof(Frame_t) + PIPE_ARENA_STATE;
+    Pipe.arena = (unsigned char*)malloc(Pipe.arena_size);
+    if (Pipe.arena == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    Frame_t* frames = (Frame_t*)pipe_alloc(PIPE_FRAMES * sizeof(Frame_t));
+    for (int i = 0; i < PIPE_FRAMES; i++)
+        frame_free(&frames[i]);
+
+    if (ReorderWindow > 0 && reorder_init())
+        return 1;
+    return loop_epoll();
+}
+
+void pipe_print(void)
+{
+    for (int i = 0; i < Pipe.n_stages; i++) {
+        Stage_t* s = &Pipe.stages[i];
+        printf("\n  stage %-8s %10llu in %10llu out", s->name, s->count_in, s->count_out);
+        if (s->print != NULL)
+            s->print(s);
+    }
+    if (Pipe.count_overflow)
+        printf("\n  pipeline %llu dropped, no free frame", Pipe.count_overflow);
+    printf("\n");
+}
+
+#endif // _WIN32
+
+//=======================================
+// Hot restart, stage state (Linux only)
+//
+// The stages carry stream state from one datagram to the next: CC and
+// PSI tables of the ETR 290 checks, MIP megaframe tracking, the T2-MI
+// and PES parsers with their language pages, fingerprint chunks, the
+// monitor's PMT list, PCR jitter history, the impairment generator and
+// the next RTP sequence number of the reorder stage. The running
+// instance sends each as it is, the successor takes it over only if
+// its own stage is set up with the same configuration (key), else that
+// stage starts cold. Pointers into msgbuf stay behind the datagram
+// counters of their stage and are never followed after the switch.
+
+#ifndef _WIN32
+
+typedef struct {
+    int n_pids;
+    unsigned long long int pos;
+    PcrJitter_t pids[JIT_MAX_PIDS];
+} JitterState_t;
+
+JitterState_t JitterState;
+
+unsigned int handoff_key(unsigned int h, const char* s)
+{
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;    // FNV-1a
+    return h;
+}
+
+void handoff_state(HandoffState_t* st, void* p, unsigned int len, unsigned int key)
+{
+    st->p = p;
+    st->len = len;
+    st->key = key;
+}
+
+// states of the stages running here, to send or to match what was received
+void handoff_states(HandoffState_t* st)
+{
+    memset(st, 0, HANDOFF_STATES * sizeof(*st));
+    if (EtrMonitor)
+        handoff_state(&st[HANDOFF_ETR], &Etr, sizeof(Etr), ETR_MAX_PIDS);
+    if (MipCheck) {
+        handoff_state(&st[HANDOFF_MIP_IN], &MipIn, sizeof(MipIn), MIP_PID);
+        handoff_state(&st[HANDOFF_MIP_OUT], &MipOut, sizeof(MipOut), MIP_PID);
+    }
+    if (T2miPid >= 0)
+        handoff_state(&st[HANDOFF_T2MI], &T2mi, sizeof(T2mi), T2miPid << 8 | (T2miPlp & 0xFF));
+    if (PesSpecCount > 0) {
+        unsigned int key = 2166136261u;
+        for (int i = 0; i < PesSpecCount; i++)
+            key = handoff_key(key, PesSpec[i]);
+        handoff_state(&st[HANDOFF_PES], Pes, sizeof(*Pes), key);
+    }
+    if (FpFile != NULL)
+        handoff_state(&st[HANDOFF_FP], &Fp, sizeof(Fp), Fp.mask << 1 | Fp.rehash);
+    if (MonitorSpec != NULL)
+        handoff_state(&st[HANDOFF_MONITOR], &Monitor, sizeof(Monitor), Monitor.every);
+    if (PcrJitter) {
+        JitterState.n_pids = jit_n_pids;
+        JitterState.pos = jit_pos;
+        memcpy(JitterState.pids, JitPids, sizeof(JitPids));
+        handoff_state(&st[HANDOFF_JITTER], &JitterState, sizeof(JitterState), JIT_MAX_PIDS);
+    }
+    if (ImpairProfile != NULL)
+        handoff_state(&st[HANDOFF_IMPAIR], Impair, sizeof(*Impair), handoff_key(2166136261u, ImpairProfile));
+    for (int i = 0; i < Pipe.n_stages; i++)
+        if (!strcmp(Pipe.stages[i].name, "reorder"))
+            handoff_state(&st[HANDOFF_REORDER], Pipe.stages[i].state, sizeof(Reorder_t), ReorderWindow);
+}
+
+// take over the states received by handoff_receive(), stages set up
+void handoff_apply(void)
+{
+    HandoffState_t own[HANDOFF_STATES];
+    handoff_states(own);
+    for (int i = 0; i < HANDOFF_STATES; i++)
+    {
+        HandoffState_t* in = &HandoffIn[i];
+        if (in->len == 0)
+            continue;
+        if (own[i].len != in->len || own[i].key != in->key) {
+            printf("handoff: %s state not taken over, not set up the same here\n", handoff_name[i]);
+            free(in->p);
+            continue;
+        }
+
+        // what belongs to this process stays: names, files, addresses, buffers
+        switch (i) {
+        case HANDOFF_MIP_IN:
+        case HANDOFF_MIP_OUT: {
+            Mip_t* mip = (Mip_t*)own[i].p;
+            const char* name = mip->name;
+            memcpy(mip, in->p, in->len);
+            mip->name = name;
+            break;
+        }
+        case HANDOFF_FP: {
+            FILE* f = Fp.f;
+            memcpy(&Fp, in->p, in->len);
+            Fp.f = f;
+            break;
+        }
+        case HANDOFF_MONITOR: {
+            Addr_t addr = Monitor.addr;
+            memcpy(&Monitor, in->p, in->len);
+            Monitor.addr = addr;
+            break;
+        }
+        case HANDOFF_JITTER:
+            memcpy(&JitterState, in->p, in->len);
+            jit_n_pids = JitterState.n_pids;
+            jit_pos = JitterState.pos;
+            memcpy(JitPids, JitterState.pids, sizeof(JitPids));
+            break;
+        case HANDOFF_REORDER: {
+            Reorder_t* r = (Reorder_t*)own[i].p;
+            Frame_t** slot = r->slot;
+            unsigned long long int hold_ns = r->hold_ns;
+            memcpy(r, in->p, in->len);
+            r->slot = slot;     // empty, the previous instance sent what it held
+            r->hold_ns = hold_ns;
+            r->n_held = 0;
+            break;
+        }
+        default:
+            memcpy(own[i].p, in->p, in->len);
+        }
+        free(in->p);
+        printf("handoff: %s state taken over\n", handoff_name[i]);
+    }
+}
+
+#endif // _WIN32
+
+//=======================================
+// Multi-route mode (Linux only)
+//
+// -r routes.conf filters many streams in one process, one route per
+// line: mcast_in port_in mcast_out port_out [prio=n] pid1 [pid2 ...]
+//
+// Each route is a task. Its input socket is registered EPOLLONESHOT
+// on the epoll of a home worker, so once reported ready the route
+// belongs to exactly one worker until it is re-armed: datagrams of a
+// route are always handled in order by one thread at a time. A worker
+// runs a route for up to ROUTE_BUDGET datagrams, then re-queues it on
+// its own deque if data is left, or re-arms it. An idle worker first
+// steals the oldest route from another worker's deque, then polls the
+// other workers' epolls, before sleeping briefly on its own. With
+// -static routes never leave their home worker.
+//
+// Batching adapts to the load: each route reads with recvmmsg() in
+// batches that double when a read fills the batch (queue building up)
+// and halve when it comes back half empty or less. Each worker tracks its
+// arrival rate; when it is high enough that a few datagrams arrive
+// within the latency target (-L), an idle worker sleeps for the time
+// needed to collect about ADAPT_BATCH datagrams, never more than the
+// target, instead of waking up per datagram.
+//
+// With -C each batch is bracketed by TSC reads around recvmmsg(), the
+// patch loop and sendmmsg(), summed per route and per worker.
+//
+// Routes have a priority (prio=N on their line, default 0, higher is
+// more important). The main thread checks for overload every 100 ms:
+// kernel drops on a served route (SO_MEMINFO), a worker busy for more
+// than OVERLOAD_LAG_MS without going idle (time spent waiting for work
+// does not count), or too many runnable routes
+// queued on a worker. Each overloaded tick sheds the lowest priority
+// still served, never the highest one: shed routes are parked (not
+// re-armed) so they cost nothing and the kernel drops their traffic.
+// After OVERLOAD_CALM_TICKS quiet ticks the last shed level is restored.
+//
+// To scale to thousands of routes, route state is kept as parallel
+// arrays (Routes.field[r]) rather than one struct per route: a run only
+// touches the fd, batch, PID table index, destination and counters of
+// its route, not the description or overload bookkeeping. Hide lists
+// are sorted and deduplicated into shared PID tables, so routes with
+// the same list share one copy.
+
+#ifndef _WIN32
+
+#define ROUTE_BUDGET    32      // datagrams per run before yielding
+#define ROUTE_MAX_PIDS  100
+#define ROUTE_IDLE_MS   1       // idle wait before trying to steal again
+#define ROUTE_MAX_BATCH 32      // recvmmsg / sendmmsg batch limit
+#define ADAPT_BATCH     8       // datagrams worth collecting per wake up
+#define ADAPT_PERIOD    0.01    // s between arrival rate updates
+
+#define OVERLOAD_TICK_MS    100
+#define OVERLOAD_LAG_MS     20      // worker busy without a break
+#define OVERLOAD_QUEUE      16      // runnable routes waiting on a worker
+#define OVERLOAD_CALM_TICKS 30
+
+#define ROUTE_ARMED     0       // in epoll, a deque or being run
+#define ROUTE_PARKED    1       // shed, waiting to be re-armed
+
+// per-route state, one array per field, hot fields first
+typedef struct {
+    int* fd_in;
+    unsigned char* batch;       // current recvmmsg size
+    int* table;                 // index in PidTables
+    Addr_t* addr_out;
+    Stats_t* stats;
+    unsigned long long int (*cycles)[STAGE_COUNT];  // -C, parse is part of patch
+
+    int* home;                  // worker whose epoll watches fd_in
+    int* prio;
+    volatile int* state;        // ROUTE_ARMED or ROUTE_PARKED
+    unsigned int* drops_last;   // kernel drop counter at last check
+    unsigned long long int* drops;
+    unsigned long long int* drops_shed; // part of drops while shed
+    char (*in_desc)[48];        // "239.255.255.255:65535", IPv6 may be cut
+} Routes_t;
+
+// shared hide lists, pids of table t at pool[first[t]], sorted, found
+// by a hash of the list (open addressing, table index + 1, 0 = free)
+typedef struct {
+    int* first;
+    int* n_pids;
+    int n_tables;
+    unsigned short* pool;       // grows with the distinct lists
+    int n_pool, pool_size;
+    int* hash;
+    unsigned int hash_mask;
+} PidTables_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int* ring;                  // route indices, capacity = route count
+    int head, count;
+} RouteDeque_t;
+
+typedef struct {
+    int id;
+    int epfd;
+    RouteDeque_t q;
+    unsigned long long int count_runs;
+    unsigned long long int count_stolen;
+    unsigned long long int count_udp;
+    unsigned long long int count_syscalls;  // recvmmsg + sendmmsg
+    unsigned long long int cycles[STAGE_COUNT]; // -C, summed over its runs
+
+    // load adaptation
+    double rate;                // datagrams/s, smoothed
+    double rate_time;
+    unsigned long long int rate_udp;
+    int coalesce_us;            // sleep before polling when idle
+    volatile double last_idle;  // last time the worker ran out of work
+    volatile int waiting;       // idle in the wait for work, no lag
+
+    struct mmsghdr msgs[ROUTE_MAX_BATCH];
+    struct iovec iovs[ROUTE_MAX_BATCH];
+    unsigned char buf[ROUTE_MAX_BATCH][MSGBUFSIZE];
+} Worker_t;
+
+Routes_t Routes;
+PidTables_t PidTables;
+int n_routes = 0;
+Worker_t* workers = NULL;
+int n_workers = 0;
+
+volatile int ShedLevel = 0;     // routes with prio < ShedLevel are shed
+unsigned long long int count_shed_events = 0;
+unsigned long long int count_restore_events = 0;
+
+void deque_push(RouteDeque_t* q, int r)
+{
+    pthread_mutex_lock(&q->lock);
+    q->ring[(q->head + q->count++) % n_routes] = r;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// owner takes the newest route (cache warm), thieves the oldest
+int deque_pop(RouteDeque_t* q, int oldest)
+{
+    int r = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        if (oldest) {
+            r = q->ring[q->head];
+            q->head = (q->head + 1) % n_routes;
+        }
+        else
+            r = q->ring[(q->head + q->count - 1) % n_routes];
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+void route_arm(int r, int op)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u32 = r;
+    if (epoll_ctl(workers[Routes.home[r]].epfd, op, Routes.fd_in[r], &ev) < 0)
+        perror("epoll_ctl");
+}
+
+// ready routes reported by an epoll go to the deque of w, returns one
+int route_poll(Worker_t* w, int epfd, int timeout_ms)
+{
+    struct epoll_event ev[64];
+    int n = epoll_wait(epfd, ev, 64, timeout_ms);
+    for (int i = 1; i < n; i++)
+        deque_push(&w->q, ev[i].data.u32);
+    return n > 0 ? (int)ev[0].data.u32 : -1;
+}
+
+// -C: TSC of one stage of a batch, per route and per worker
+static inline void route_cycles(Worker_t* w, int r, int stage, unsigned long long int from, unsigned long long int to)
+{
+    Routes.cycles[r][stage] += to - from;
+    w->cycles[stage] += to - from;
+}
+
+// run a route for up to ROUTE_BUDGET datagrams, 1 if its socket is drained
+int route_run(Worker_t* w, int r)
+{
+    int fd_in = Routes.fd_in[r];
+    int batch = Routes.batch[r];
+    int table = Routes.table[r];
+    const unsigned short* pids = PidTables.pool + PidTables.first[table];
+    int n_pids = PidTables.n_pids[table];
+    Stats_t* stats = &Routes.stats[r];
+
+    for (int done = 0; done < ROUTE_BUDGET; )
+    {
+        for (int i = 0; i < batch; i++) {
+            w->iovs[i].iov_base = w->buf[i];
+            w->iovs[i].iov_len = MSGBUFSIZE;
+            memset(&w->msgs[i].msg_hdr, 0, sizeof(w->msgs[i].msg_hdr));
+            w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+            w->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        unsigned long long int tsc = CycleAccounting ? read_tsc() : 0;
+        int n = recvmmsg(fd_in, w->msgs, batch, MSG_DONTWAIT, NULL);
+        w->count_syscalls++;
+        if (CycleAccounting) {
+            unsigned long long int t = read_tsc();
+            route_cycles(w, r, STAGE_RECEIVE, tsc, t);
+            tsc = t;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg");
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int n_in = w->msgs[i].msg_len;
+            int n_ts = n_in / TS_LEN;
+            int ts_offset = n_in - n_ts * TS_LEN;
+            stats->count_patched += patch_ts(w->buf[i] + ts_offset, n_ts, pids, n_pids, NULL, NULL, NULL);
+            stats->count_ts += n_ts;
+
+            w->iovs[i].iov_len = n_in;
+            w->msgs[i].msg_hdr.msg_name = &Routes.addr_out[r];
+            w->msgs[i].msg_hdr.msg_namelen = addr_len(&Routes.addr_out[r]);
+        }
+        stats->count_udp += n;
+        w->count_udp += n;
+        done += n;
+        if (CycleAccounting) {
+            unsigned long long int t = read_tsc();
+            route_cycles(w, r, STAGE_PATCH, tsc, t);
+            tsc = t;
+        }
+
+        // sendmmsg() stops short at a datagram that fails: count it
+        // as a send error of the route and send the rest
+        int fd_out_r = Routes.addr_out[r].sa.sa_family == AF_INET6 ? fd_out6 : fd_out;
+        for (int sent = 0; sent < n; ) {
+            int k = sendmmsg(fd_out_r, w->msgs + sent, n - sent, 0);
+            w->count_syscalls++;
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0) {
+                stats->count_send_err++;
+                k = 1;
+            }
+            sent += k;
+        }
+        if (CycleAccounting)
+            route_cycles(w, r, STAGE_SEND, tsc, read_tsc());
+
+        // a full batch means the queue is building up
+        int full = n == batch;
+        if (full && batch < ROUTE_MAX_BATCH)
+            batch *= 2;
+        else if (n * 2 <= batch && batch > 1)
+            batch /= 2;
+        Routes.batch[r] = (unsigned char)batch;
+        if (!full)
+            return 1;
+    }
+    return 0;
+}
+
+// arrival rate of a worker and the idle sleep it allows
+void worker_adapt(Worker_t* w)
+{
+    double now = wall_time();
+    if (now - w->rate_time < ADAPT_PERIOD)
+        return;
+    double rate = (w->count_udp - w->rate_udp) / (now - w->rate_time);
+    w->rate = w->rate == 0 ? rate : 0.7 * w->rate + 0.3 * rate;
+    w->rate_time = now;
+    w->rate_udp = w->count_udp;
+
+    // time to collect ADAPT_BATCH datagrams, only if within the target
+    double wait_us = w->rate > 0 ? ADAPT_BATCH * 1e6 / w->rate : 1e9;
+    w->coalesce_us = wait_us <= LatencyTarget ? (int)wait_us : 0;
+}
+
+THREAD_FUNC(route_worker)
+{
+    Worker_t* w = (Worker_t*)arg;
+    while (1)
+    {
+        int r = deque_pop(&w->q, 0);
+        if (r < 0)
+            r = route_poll(w, w->epfd, 0);
+        for (int i = 1; r < 0 && !RoutesStatic && i < n_workers; i++) {
+            Worker_t* victim = &workers[(w->id + i) % n_workers];
+            r = deque_pop(&victim->q, 1);
+            if (r < 0)
+                r = route_poll(w, victim->epfd, 0);
+            if (r >= 0)
+                w->count_stolen++;
+        }
+        if (r < 0) {
+            w->last_idle = wall_time();
+            worker_adapt(w);
+            w->waiting = 1;
+            if (w->coalesce_us > 0) {
+                // high rate: let a batch build up rather than wake per datagram
+                sleep_ns(w->coalesce_us * 1000ULL);
+                r = route_poll(w, w->epfd, 0);
+            }
+            else
+                r = route_poll(w, w->epfd, RoutesStatic ? ROUTE_IDLE_MS * 100 : ROUTE_IDLE_MS);
+            // busy again from now on, never since before the wait
+            w->last_idle = wall_time();
+            w->waiting = 0;
+            if (r < 0)
+                continue;
+        }
+
+        // a shed route is parked before it is run, or again after the
+        // run if the level went up meanwhile
+        if (Routes.prio[r] < ShedLevel) {
+            __atomic_store_n(&Routes.state[r], ROUTE_PARKED, __ATOMIC_RELEASE);
+            continue;
+        }
+        w->count_runs++;
+        int drained = route_run(w, r);
+        if (Routes.prio[r] < ShedLevel)
+            __atomic_store_n(&Routes.state[r], ROUTE_PARKED, __ATOMIC_RELEASE);
+        else if (drained)
+            route_arm(r, EPOLL_CTL_MOD);
+        else
+            deque_push(&w->q, r);
+    }
+    return 0;
+}
+
+// lowest priority above level among the routes, or level if none
+int next_prio(int level)
+{
+    int next = level;
+    for (int r = 0; r < n_routes; r++)
+        if (Routes.prio[r] >= level && (next == level || Routes.prio[r] < next))
+            next = Routes.prio[r] + 1;
+    return next;
+}
+
+void log_time(void)
+{
+    time_t now = time(NULL);
+    char tbuf[32];
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    printf("%s ", tbuf);
+}
+
+// one monitor tick: measure, shed or restore, re-arm parked routes
+void overload_tick(void)
+{
+    static int calm = 0;
+    static int levels[64];          // shed levels, to restore in reverse
+    static int n_levels = 0;
+    double now = wall_time();
+
+    unsigned int new_drops = 0;
+    for (int r = 0; r < n_routes; r++) {
+        unsigned int meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (getsockopt(Routes.fd_in[r], SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0)
+            continue;
+        unsigned int d = meminfo[SK_MEMINFO_DROPS] - Routes.drops_last[r];
+        Routes.drops_last[r] = meminfo[SK_MEMINFO_DROPS];
+        Routes.drops[r] += d;
+        if (Routes.prio[r] < ShedLevel)
+            Routes.drops_shed[r] += d;
+        else
+            new_drops += d;
+    }
+    double lag = 0;
+    int queue = 0;
+    for (int i = 0; i < n_workers; i++) {
+        if (!workers[i].waiting && now - workers[i].last_idle > lag)
+            lag = now - workers[i].last_idle;
+        if (workers[i].q.count > queue)
+            queue = workers[i].q.count;
+    }
+
+    int overloaded = new_drops > 0 || lag * 1000 > OVERLOAD_LAG_MS || queue > OVERLOAD_QUEUE;
+    if (overloaded) {
+        calm = 0;
+        int next = next_prio(ShedLevel);
+        // keep at least the most important priority served
+        if (next != ShedLevel && next_prio(next) != next && n_levels < 64) {
+            levels[n_levels++] = ShedLevel;
+            ShedLevel = next;
+            count_shed_events++;
+            int n_shed = 0;
+            for (int r = 0; r < n_routes; r++)
+                n_shed += Routes.prio[r] < ShedLevel;
+            log_time();
+            printf("overload (%u drops, %.1f ms lag, %d queued): shedding prio < %d, %d route(s)\n",
+                new_drops, lag * 1000, queue, ShedLevel, n_shed);
+        }
+    }
+    else if (n_levels > 0 && ++calm >= OVERLOAD_CALM_TICKS) {
+        calm = 0;
+        ShedLevel = levels[--n_levels];
+        count_restore_events++;
+        log_time();
+        printf("load back to normal: serving prio >= %d\n", ShedLevel);
+    }
+
+    // parked routes that are served again go back to their epoll
+    for (int r = 0; r < n_routes; r++) {
+        if (Routes.prio[r] >= ShedLevel
+            && __atomic_load_n(&Routes.state[r], __ATOMIC_ACQUIRE) == ROUTE_PARKED) {
+            Routes.state[r] = ROUTE_ARMED;
+            route_arm(r, EPOLL_CTL_MOD);
+        }
+    }
+}
+
+int cmp_pid(const void* a, const void* b)
+{
+    return *(const unsigned short*)a - *(const unsigned short*)b;
+}
+
+// index of the table holding this sorted, duplicate free list, added if
+// new, -1 if out of memory
+int pid_table(const unsigned short* pids, int n_pids)
+{
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (int i = 0; i < n_pids; i++) {
+        h = (h ^ (pids[i] & 0xFF)) * 16777619u;
+        h = (h ^ (pids[i] >> 8)) * 16777619u;
+    }
+    for (h &= PidTables.hash_mask; PidTables.hash[h] != 0; h = (h + 1) & PidTables.hash_mask) {
+        int t = PidTables.hash[h] - 1;
+        if (PidTables.n_pids[t] == n_pids
+            && !memcmp(PidTables.pool + PidTables.first[t], pids, n_pids * sizeof(*pids)))
+            return t;
+    }
+
+    if (PidTables.n_pool + n_pids > PidTables.pool_size) {
+        int size = PidTables.pool_size * 2 >= PidTables.n_pool + n_pids
+            ? PidTables.pool_size * 2 : PidTables.n_pool + n_pids;
+        unsigned short* pool = (unsigned short*)realloc(PidTables.pool, size * sizeof(*pool));
+        if (pool == NULL)
+            return -1;
+        PidTables.pool = pool;
+        PidTables.pool_size = size;
+    }
+    int t = PidTables.n_tables++;
+    PidTables.first[t] = PidTables.n_pool;
+    PidTables.n_pids[t] = n_pids;
+    memcpy(PidTables.pool + PidTables.n_pool, pids, n_pids * sizeof(*pids));
+    PidTables.n_pool += n_pids;
+    PidTables.hash[h] = t + 1;
+    return t;
+}
+
+int load_routes(void)
+{
+    FILE* f = fopen(RoutesFile, "r");
+    if (f == NULL) {
+        perror(RoutesFile);
+        return 1;
+    }
+
+    // size the arrays once, from the line count
+    char line[1024];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        capacity++;
+    rewind(f);
+    Routes.fd_in = (int*)calloc(capacity + 1, sizeof(int));
+    Routes.batch = (unsigned char*)calloc(capacity + 1, sizeof(unsigned char));
+    Routes.table = (int*)calloc(capacity + 1, sizeof(int));
+    Routes.addr_out = (Addr_t*)calloc(capacity + 1, sizeof(Addr_t));
+    Routes.stats = (Stats_t*)calloc(capacity + 1, sizeof(Stats_t));
+    Routes.cycles = (unsigned long long int(*)[STAGE_COUNT])calloc(capacity + 1, sizeof(*Routes.cycles));
+    Routes.home = (int*)calloc(capacity + 1, sizeof(int));
+    Routes.prio = (int*)calloc(capacity + 1, sizeof(int));
+    Routes.state = (volatile int*)calloc(capacity + 1, sizeof(int));
+    Routes.drops_last = (unsigned int*)calloc(capacity + 1, sizeof(unsigned int));
+    Routes.drops = (unsigned long long int*)calloc(capacity + 1, sizeof(unsigned long long int));
+    Routes.drops_shed = (unsigned long long int*)calloc(capacity + 1, sizeof(unsigned long long int));
+    Routes.in_desc = (char(*)[48])calloc(capacity + 1, sizeof(*Routes.in_desc));
+    PidTables.first = (int*)calloc(capacity + 1, sizeof(int));
+    PidTables.n_pids = (int*)calloc(capacity + 1, sizeof(int));
+    PidTables.pool_size = ROUTE_MAX_PIDS;
+    PidTables.pool = (unsigned short*)malloc(PidTables.pool_size * sizeof(unsigned short));
+    PidTables.hash_mask = 1;
+    while (PidTables.hash_mask < 2u * (capacity + 1))
+        PidTables.hash_mask *= 2;
+    PidTables.hash = (int*)calloc(PidTables.hash_mask--, sizeof(int));
+    if (Routes.fd_in == NULL || Routes.batch == NULL || Routes.table == NULL || Routes.addr_out == NULL
+        || Routes.stats == NULL || Routes.cycles == NULL || Routes.home == NULL || Routes.prio == NULL || Routes.state == NULL
+        || Routes.drops_last == NULL || Routes.drops == NULL || Routes.drops_shed == NULL
+        || Routes.in_desc == NULL || PidTables.first == NULL || PidTables.n_pids == NULL || PidTables.pool == NULL
+        || PidTables.hash == NULL) {
+        perror("calloc");
+        fclose(f);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL && n_routes < capacity)
+    {
+        char* tok[4 + ROUTE_MAX_PIDS];
+        int n_tok = 0;
+        for (char* t = strtok(line, " \t\r\n"); t != NULL && *t != '#' && n_tok < 4 + ROUTE_MAX_PIDS; t = strtok(NULL, " \t\r\n"))
+            tok[n_tok++] = t;
+        if (n_tok == 0)
+            continue;
+        if (n_tok < 4) {
+            printf("%s: need mcast_in port_in mcast_out port_out [prio=n] pid...\n", RoutesFile);
+            fclose(f);
+            return 1;
+        }
+        int r = n_routes;
+        snprintf(Routes.in_desc[r], sizeof(Routes.in_desc[r]), "%s:%s", tok[0], tok[1]);
+        Routes.fd_in[r] = create_input_socket(tok[0], atoi(tok[1]));
+        if (Routes.fd_in[r] < 0) {
+            fclose(f);
+            return 1;
+        }
+        if (addr_parse(&Routes.addr_out[r], tok[2], atoi(tok[3]))) {
+            fclose(f);
+            return 1;
+        }
+
+        unsigned short pids[ROUTE_MAX_PIDS];
+        int n_pids = 0;
+        for (int i = 4; i < n_tok; i++) {
+            if (!strncmp(tok[i], "prio=", 5))
+                Routes.prio[r] = atoi(tok[i] + 5);
+            else
+                pids[n_pids++] = (unsigned short)atoi(tok[i]);
+        }
+        qsort(pids, n_pids, sizeof(*pids), cmp_pid);
+        int n_unique = 0;
+        for (int i = 0; i < n_pids; i++)
+            if (n_unique == 0 || pids[n_unique - 1] != pids[i])
+                pids[n_unique++] = pids[i];
+        Routes.table[r] = pid_table(pids, n_unique);
+        if (Routes.table[r] < 0) {
+            perror("realloc");
+            fclose(f);
+            return 1;
+        }
+        Routes.batch[r] = 1;
+        n_routes++;
+    }
+    fclose(f);
+    if (n_routes == 0) {
+        printf("%s: no route\n", RoutesFile);
+        return 1;
+    }
+    return 0;
+}
+
+int run_routes(void)
+{
+    if (load_routes())
+        return 1;
+
+    // one output socket per address family in use
+    for (int r = 0; r < n_routes; r++) {
+        int* fd = Routes.addr_out[r].sa.sa_family == AF_INET6 ? &fd_out6 : &fd_out;
+        if (*fd < 0 && (*fd = create_output_socket(Routes.addr_out[r].sa.sa_family, OutputInterface)) < 0)
+            return 1;
+    }
+
+    n_workers = Threads > 0 ? Threads : cpu_count();
+    workers = (Worker_t*)calloc(n_workers, sizeof(Worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        workers[i].id = i;
+        workers[i].rate_time = wall_time();
+        workers[i].last_idle = wall_time();
+        workers[i].epfd = epoll_create1(0);
+        workers[i].q.ring = (int*)malloc(n_routes * sizeof(int));
+        pthread_mutex_init(&workers[i].q.lock, NULL);
+        if (workers[i].epfd < 0 || workers[i].q.ring == NULL) {
+            perror("worker");
+            return 1;
+        }
+    }
+    for (int r = 0; r < n_routes; r++) {
+        Routes.home[r] = r % n_workers;
+        route_arm(r, EPOLL_CTL_ADD);
+    }
+    size_t route_bytes = sizeof(int) * 5 + sizeof(unsigned char) + sizeof(Addr_t) + sizeof(Stats_t)
+        + sizeof(*Routes.cycles) + sizeof(unsigned int) + 2 * sizeof(unsigned long long int) + sizeof(*Routes.in_desc);
+    printf("Routes: %d routes on %d worker(s), %s, latency target %d us\n", n_routes, n_workers,
+        RoutesStatic ? "static" : "work stealing", LatencyTarget);
+    printf("        %d PID table(s), %d PIDs, %d bytes per route + %d bytes of tables\n", PidTables.n_tables,
+        PidTables.n_pool, (int)route_bytes, (int)(PidTables.pool_size * sizeof(unsigned short) + PidTables.n_tables * 2 * sizeof(int)
+            + (PidTables.hash_mask + 1) * sizeof(int)));
+
+    // tspidfilter-top shows the totals, the adaptation of each worker
+    // and the counters of each route
+    if (StatsShmName != NULL) {
+        InputMCast = RoutesFile;
+        RouteStats.n_workers = n_workers < SHM_MAX_WORKERS ? n_workers : SHM_MAX_WORKERS;
+        StatsShmRoutes = n_routes;
+        if (stats_shm_create())
+            return 1;
+        unsigned int seq = stats_shm_begin();
+        RouteShm_t* rs = stats_shm_route(stats_shm);
+        for (int r = 0; r < n_routes; r++) {
+            memcpy(rs[r].in_desc, Routes.in_desc[r], sizeof(rs[r].in_desc));
+            rs[r].prio = Routes.prio[r];
+        }
+        stats_shm_end(seq);
+    }
+
+    if (CycleAccounting)
+        cycles_start();
+    for (int i = 0; i < n_workers; i++) {
+        thread_t t;
+        if (thread_start(&t, route_worker, &workers[i])) {
+            perror("worker thread");
+            return 1;
+        }
+    }
+
+    // counters are read unlocked, they are only for display
+    for (int tick = 1; ; tick++)
+    {
+        struct timespec ts = { 0, OVERLOAD_TICK_MS * 1000000L };
+        nanosleep(&ts, NULL);
+        overload_tick();
+        int display = tick % (5000 / OVERLOAD_TICK_MS) == 0;
+        if (!display && stats_shm == NULL)
+            continue;
+
+        Stats_t total = { 0, 0, 0, 0 };
+        int batch_sum = 0;
+        for (int r = 0; r < n_routes; r++) {
+            total.count_udp += Routes.stats[r].count_udp;
+            total.count_ts += Routes.stats[r].count_ts;
+            total.count_patched += Routes.stats[r].count_patched;
+            total.count_send_err += Routes.stats[r].count_send_err;
+            batch_sum += Routes.batch[r];
+        }
+        RouteStats.mean_batch = (double)batch_sum / n_routes;
+        for (int i = 0; i < RouteStats.n_workers; i++) {
+            Worker_t* w = &workers[i];
+            RouteStats.workers[i].rate = w->rate;
+            RouteStats.workers[i].coalesce_us = w->coalesce_us;
+            RouteStats.workers[i].udp_per_syscall = w->count_syscalls ? (double)w->count_udp / w->count_syscalls : 0.0;
+            RouteStats.workers[i].count_udp = w->count_udp;
+            memcpy(RouteStats.workers[i].cycles, w->cycles, sizeof(w->cycles));
+        }
+        // -C: process totals are the sums over the workers
+        if (CycleAccounting) {
+            for (int stage = 0; stage < STAGE_COUNT; stage++) {
+                CycleStats.cycles[stage] = 0;
+                for (int i = 0; i < n_workers; i++)
+                    CycleStats.cycles[stage] += workers[i].cycles[stage];
+                CycleStats.count[stage] = stage == STAGE_PARSE ? 0 : total.count_udp;
+            }
+            CycleStats.tsc_now = read_tsc();
+            CycleStats.time_now = wall_time();
+        }
+        if (stats_shm != NULL) {
+            unsigned int seq = stats_shm_begin();
+            RouteShm_t* rs = stats_shm_route(stats_shm);
+            for (int r = 0; r < n_routes; r++) {
+                rs[r].stats = Routes.stats[r];
+                rs[r].drops = Routes.drops[r];
+                rs[r].shed = Routes.prio[r] < ShedLevel;
+                memcpy(rs[r].cycles, Routes.cycles[r], sizeof(rs[r].cycles));
+            }
+            stats_shm_end(seq);
+            Stats = total;
+            stats_shm_publish(STATS_SHM_ROUTES | STATS_SHM_CYCLES);
+            stats_shm_history(time(NULL));
+        }
+        if (!display)
+            continue;
+
+        unsigned long long int drops = 0, drops_shed = 0;
+        int n_shed = 0;
+        for (int r = 0; r < n_routes; r++) {
+            drops += Routes.drops[r];
+            drops_shed += Routes.drops_shed[r];
+            n_shed += Routes.prio[r] < ShedLevel;
+        }
+        printf("%8llu UDP, %8llu TS, %8llu patched, mean batch %.1f\n", total.count_udp, total.count_ts,
+            total.count_patched, RouteStats.mean_batch);
+        printf("  shed prio < %d (%d routes), %llu shed / %llu restore events, %llu drops (%llu while shed)\n",
+            ShedLevel, n_shed, count_shed_events, count_restore_events, drops, drops_shed);
+        if (total.count_send_err > 0) {
+            int n_err = 0;
+            for (int r = 0; r < n_routes; r++)
+                n_err += Routes.stats[r].count_send_err > 0;
+            printf("  %llu send errors on %d route(s)\n", total.count_send_err, n_err);
+        }
+        for (int i = 0; i < n_workers; i++) {
+            Worker_t* w = &workers[i];
+            printf("  w%-3d %10llu runs %8llu stolen %10.0f UDP/s %5d us coalesce %6.2f UDP/syscall",
+                i, w->count_runs, w->count_stolen, w->rate, w->coalesce_us,
+                w->count_syscalls ? (double)w->count_udp / w->count_syscalls : 0.0);
+            if (CycleAccounting && w->count_udp > 0)
+                printf(" %6llu rx %6llu patch %6llu tx cycles/UDP", w->cycles[STAGE_RECEIVE] / w->count_udp,
+                    w->cycles[STAGE_PATCH] / w->count_udp, w->cycles[STAGE_SEND] / w->count_udp);
+            printf("\n");
+        }
+        if (CycleAccounting)
+            cycles_print(&CycleStats);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+#endif // _WIN32
+
+void usage(char* name)
+{
+    printf("usage  : %s mcast_in port_in mcast_out port_out pid1 [pid2 ...]\n", name);
+    printf("         %s -f in.ts out.ts [-j threads] pid1 [pid2 ...]\n", name);
+    printf("         %s -A secs mcast_in port_in [pid1 ...]\n", name);
+#ifndef _WIN32
+    printf("         %s -r routes.conf [-j workers] [-static] [-L latency_us] [-C] [-S name]\n", name);
+#endif
+    printf("         mcast_in may be source@group (SSM), groups are IPv4 or IPv6\n");
+    printf("options: -i iface  join the input group on this interface (name, index or IPv4 address)\n");
+    printf("         -o iface  send multicast through this interface (name or index)\n");
+    printf("         -o iface[=mcast] again: also send through iface, to the output or its own group\n");
+    printf("         -A secs   dry run: list programs, PIDs, stream types, bitrates and what the\n");
+    printf("                   PID list would hide, live for secs (10) or a capture (0: all)\n");
+    printf("         -C        account TSC cycles per stage (file mode: per thread, -r: per route and worker)\n");
+    printf("         -E        ETR 290 priority 1 and 2 checks on the input (live mode)\n");
+    printf("         -M        verify SFN MIP (PID 0x15) pointer and STS on input and output (live mode)\n");
+    printf("         -T pid[:plp] also hide the PIDs inside the T2-MI stream on this PID, all PLPs or one (live mode)\n");
+    printf("         -X pid:item[,item] blank teletext pages (page=888), subtitle page_ids (id=2) or the\n");
+    printf("                   subtitle pages of a language (fra) inside this PID (live mode)\n");
+    printf("         -F file[:bits] append per-PID input/output chunk hashes, 2^bits packets per chunk, 10 (live mode)\n");
+    printf("         -I prof   impair input, e.g. seed=1,drop=0.01,burst=3,dup=0.005,reorder=0.01,delay=20,jitter=5\n");
+#ifndef _WIN32
+    printf("         -H path   hot restart, take over from / hand over to another instance\n");
+    printf("         -S name   publish stats in shared memory, view with tspidfilter-top name\n");
+    printf("         -m mcast:port:n|psi  monitor output, every nth datagram or PSI + PCR packets only\n");
+    printf("         -Q n[:head|tail][:ms] non-blocking output, queue n datagrams per output, drop\n");
+    printf("                   oldest (head) or newest (tail) when full, and late ones after ms\n");
+    printf("         -reorder n[:ms] put RTP input back in order, hold up to n datagrams for ms (20)\n");
+    printf("         -J        PCR interval, accuracy and jitter histograms per PCR PID\n");
+    printf("         -P n      measure cycles, instructions, cache misses per stage every n datagrams\n");
+#endif
+#ifndef _WIN32
+    printf("bench  : %s -G mcast_base port n_streams mbit_per_stream seconds\n", name);
+    printf("         %s -K mcast_base port n_streams seconds\n", name);
+    printf("replay : %s -R [-rtp] [-loop] [-n ts_per_udp] [-t seconds] file.ts|synth:pids:mbit mcast port\n", name);
+#endif
+    printf("example: %s 239.1.2.3 5000 239.3.2.1 6000 100 110 120\n", name);
+    exit(1);
+}
+
+void parse_args(int argc, char** argv)
+{
+    int arg = 1;
+
+    // options first
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (!strcmp(argv[arg], "-f") && arg + 2 < argc) {
+            FileIn = argv[arg + 1];
+            FileOut = argv[arg + 2];
+            arg += 3;
+        }
+        else if (!strcmp(argv[arg], "-A") && arg + 1 < argc) {
+            AnalyzeSeconds = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-C")) {
+            CycleAccounting = 1;
+            arg += 1;
+        }
+        else if (!strcmp(argv[arg], "-E")) {
+            EtrMonitor = 1;
+            arg += 1;
+        }
+        else if (!strcmp(argv[arg], "-M")) {
+            MipCheck = 1;
+            arg += 1;
+        }
+        else if (!strcmp(argv[arg], "-T") && arg + 1 < argc) {
+            char* plp = strchr(argv[arg + 1], ':');
+            T2miPid = atoi(argv[arg + 1]);
+            T2miPlp = plp ? atoi(plp + 1) : -1;
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-X") && arg + 1 < argc) {
+            if (PesSpecCount == PES_MAX_PIDS) {
+                printf("-X: too many PIDs, at most %d\n", PES_MAX_PIDS);
+                exit(1);
+            }
+            PesSpec[PesSpecCount++] = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-F") && arg + 1 < argc) {
+            char* bits = strchr(argv[arg + 1], ':');
+            if (bits != NULL) {
+                *bits = 0;
+                FpBits = atoi(bits + 1) > 0 && atoi(bits + 1) < 24 ? atoi(bits + 1) : FpBits;
+            }
+            FpFile = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-i") && arg + 1 < argc) {
+            InputInterface = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-o") && arg + 1 < argc) {
+            // first one for the main output, then iface[=mcast] redundant ones
+            char* mcast = strchr(argv[arg + 1], '=');
+            if (OutputInterface == NULL && mcast == NULL)
+                OutputInterface = argv[arg + 1];
+            else if (OutputCount < OUTPUT_MAX) {
+                if (mcast != NULL)
+                    *mcast++ = 0;
+                Outputs[OutputCount].iface = argv[arg + 1];
+                Outputs[OutputCount++].mcast = mcast;
+            }
+            else
+                usage(argv[0]);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-I") && arg + 1 < argc) {
+            ImpairProfile = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+            Threads = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+#ifndef _WIN32
+        else if (!strcmp(argv[arg], "-H") && arg + 1 < argc) {
+            HandoffPath = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-r") && arg + 1 < argc) {
+            RoutesFile = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-L") && arg + 1 < argc) {
+            LatencyTarget = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-static")) {
+            RoutesStatic = 1;
+            arg += 1;
+        }
+        else if (!strcmp(argv[arg], "-S") && arg + 1 < argc) {
+            StatsShmName = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-m") && arg + 1 < argc) {
+            MonitorSpec = argv[arg + 1];
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-Q") && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+            char* policy = strchr(argv[arg + 1], ':');
+            SendQueueLen = atoi(argv[arg + 1]);
+            if (policy != NULL && strncmp(policy + 1, "head", 4) && strncmp(policy + 1, "tail", 4))
+                SendQueueLateMs = atoi(policy + 1);
+            else if (policy != NULL) {
+                SendQueueDropHead = !strncmp(policy + 1, "head", 4);
+                if (policy[5] == ':')
+                    SendQueueLateMs = atoi(policy + 6);
+            }
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-reorder") && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+            char* ms = strchr(argv[arg + 1], ':');
+            ReorderWindow = atoi(argv[arg + 1]);
+            if (ms != NULL && atoi(ms + 1) > 0)
+                ReorderMs = atoi(ms + 1);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-J")) {
+            PcrJitter = 1;
+            arg += 1;
+        }
+        else if (!strcmp(argv[arg], "-P") && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+            PerfEvery = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+#endif
+        else
+            usage(argv[0]);
+    }
+
+    // routes carry their own addresses and PIDs, the workers know only
+    // -i, -o, -j, -static, -L and -S: refuse what they would silently ignore
+    if (RoutesFile != NULL)
+    {
+        if (arg != argc)
+            usage(argv[0]);
+        if (FileIn != NULL || AnalyzeSeconds >= 0 || HandoffPath != NULL
+            || PerfEvery > 0 || ImpairProfile != NULL || EtrMonitor || FpFile != NULL
+            || T2miPid >= 0 || PesSpecCount > 0 || MipCheck || PcrJitter || MonitorSpec != NULL
+            || SendQueueLen > 0 || ReorderWindow > 0 || OutputCount > 0) {
+            printf("-r: only -i, -o, -j, -static, -L, -C and -S apply to multi-route mode\n");
+            exit(1);
+        }
+        return;
+    }
+
+    // these follow the stream packet by packet, file mode cuts it into
+    // slices for the workers
+    if (FileIn != NULL && (T2miPid >= 0 || PesSpecCount > 0 || FpFile != NULL || EtrMonitor || MipCheck)) {
+        printf("-f: -T, -X, -F, -E and -M apply to live mode only\n");
+        exit(1);
+    }
+
+    // a live inventory only reads, it takes no output address
+    if (FileIn == NULL && AnalyzeSeconds >= 0)
+    {
+        if (argc - arg < 2)
+            usage(argv[0]);
+        InputMCast = argv[arg++];
+        InputPort = atoi(argv[arg++]);
+    }
+    else if (FileIn == NULL)
+    {
+        if (argc - arg < 4)
+            usage(argv[0]);
+        InputMCast = argv[arg++];
+        InputPort = atoi(argv[arg++]);
+        OutputMCast = argv[arg++];
+        OutputPort = atoi(argv[arg++]);
+    }
+    if (arg >= argc && AnalyzeSeconds < 0)
+        usage(argv[0]);
+    for (; arg < argc && Pid2PatchCount < 100; )
+        Pid2Patch[Pid2PatchCount++] = atoi(argv[arg++]);
+}
+
+
+int main( int argc, char **argv)
+{
+#ifndef _WIN32
+    // installed as a symlink, the same binary is the stats viewer
+    const char* base = strrchr(argv[0], '/');
+    if (!strcmp(base ? base + 1 : argv[0], "tspidfilter-top"))
+    {
+        if (argc < 2 || argc > 4 || (argc > 2 && !strcmp(argv[2], "route") && argc != 4)) {
+            printf("usage  : %s name [1s|1m|1h [pid] | route n]\n", argv[0]);
+            return 1;
+        }
+        if (argc > 2 && !strcmp(argv[2], "route"))
+            return run_top(argv[1], NULL, -1, atoi(argv[3]));
+        return run_top(argv[1], argc > 2 ? argv[2] : NULL, argc > 3 ? atoi(argv[3]) : -1, -1);
+    }
+
+    // benchmark companions, see bench.sh
+    if (argc > 1 && !strcmp(argv[1], "-G"))
+        return run_generator(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "-K"))
+        return run_sink(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "-R"))
+        return run_replay(argc - 2, argv + 2);
+#endif
+
+    printf("tspidfilter\n");
+
+    parse_args(argc, argv);
+
+#ifndef _WIN32
+    if (RoutesFile != NULL)
+        return run_routes();
+#endif
+
+    if (FileIn == NULL)
+    {
+        printf("Input : %s : %u from %s\n", InputMCast, InputPort, InputInterface ? InputInterface : "any");
+        if (AnalyzeSeconds < 0)
+            printf("Output: %s : %u from %s\n", OutputMCast, OutputPort, OutputInterface ? OutputInterface : "any");
+        for (int o = 0; o < OutputCount; o++)
+            printf("        %s : %u from %s\n", Outputs[o].mcast ? Outputs[o].mcast : OutputMCast, OutputPort, Outputs[o].iface);
+    }
+    printf("PIDs  : ");
+    for (int i = 0; i < Pid2PatchCount; )
+    {
+        printf("%u", Pid2Patch[i++]);
+        if (i < Pid2PatchCount)
+            printf(", ");
+    }
+    printf("\n");
+
+    if (sizeof(TSHDR_t) != 4)
+    {
+        printf("TSHDR_t size error : %ld\n", sizeof(TSHDR_t));
+        exit(1);
+    }
+
+    if (FileIn != NULL && AnalyzeSeconds < 0)
+        return run_file_mode();
+
+#ifdef _WIN32
+    //
+    // Initialize Windows Socket API with given VERSION.
+    //
+    WSADATA wsaData;
+    if (WSAStartup(0x0101, &wsaData)) {
+        perror("WSAStartup");
+        return 1;
+    }
+#endif
+
+    if (AnalyzeSeconds >= 0)
+        return run_inventory();
+
+#ifndef _WIN32
+    int took_over = HandoffPath != NULL && handoff_receive() == 0;
+#else
+    int took_over = 0;
+#endif
+    if (!took_over && create_sockets())
+    {
+        printf("error create_sockets\n");
+        return 1;
+    }
+    if (create_redundant_outputs())
+        return 1;
+#ifndef _WIN32
+    if (HandoffPath != NULL && handoff_listen())
+        return 1;
+    if (StatsShmName != NULL && stats_shm_create())
+        return 1;
+#endif
+    if (PerfEvery > 0 && perf_open())
+        return 1;
+    if (CycleAccounting)
+        cycles_start();
+    if (ImpairProfile != NULL && impair_init())
+        return 1;
+    if (EtrMonitor) {
+        etr_init(wall_time());
+#ifndef _WIN32
+        // PAT, PMT and PID timeouts are raised even when the input stops
+        input_timeout(100000);
+#endif
+    }
+    if (T2miPid >= 0)
+        t2mi_init();
+    if (PesSpecCount > 0 && pes_init())
+        return 1;
+    if (FpFile != NULL && fp_init())
+        return 1;
+    if (MipCheck) {
+        crc32_init();
+        for (int i = 0; i < Pid2PatchCount; i++)
+            if (Pid2Patch[i] == MIP_PID)
+                printf("warning: MIP PID %d is hidden, the output check will report missing MIPs\n", MIP_PID);
+    }
+#ifndef _WIN32
+    if (PcrJitter && jitter_init())
+        return 1;
+    if (MonitorSpec != NULL && monitor_init())
+        return 1;
+    if (SendQueueLen > 0 && queue_init())
+        return 1;
+    if (ReorderWindow > 0 && pipe_init())
+        return 1;
+    if (took_over)
+        handoff_apply();
+#endif
+
+    //------------------------
+    // processing loop
+    Addr_t addr_in;
+    time_t last_display = 0;
+    time_t last_cycles = 0;
+    unsigned long long int perf_v[STAGE_COUNT + 1][PERF_COUNT];
+    unsigned long long int stage_tsc[STAGE_COUNT + 1];
+#ifndef _WIN32
+    int draining = 0;       // successor waiting, sending what is held
+#endif
+
+    while (1) {
+#ifndef _WIN32
+        //------------------------
+        // successor waiting: stop reading, send out what the stages
+        // hold, then hand everything over (below)
+
+        int fd_peer = __atomic_load_n(&fd_handoff_peer, __ATOMIC_ACQUIRE);
+        if (fd_peer >= 0 && !draining)
+        {
+            printf("\nhandoff: new instance waiting, sending held datagrams\n");
+            draining = 1;
+            if (ImpairProfile != NULL)
+                impair_flush();
+        }
+#endif
+
+        int perf_sample = fd_perf >= 0 && Stats.count_udp % PerfEvery == 0;
+        if (perf_sample)
+            perf_read(perf_v[STAGE_RECEIVE]);
+
+        //------------------------
+        // get UDP in, or a datagram released by the impairment stage
+
+        int addrlen = sizeof(addr_in);
+        int n_in = -1;
+        int piped = 0;      // out of the stage pipeline, goes on to parse
+#ifndef _WIN32
+        unsigned long long int rx_ns = 0;
+        if (Pipe.n_stages > 0 && (n_in = pipe_pop(msgbuf, &rx_ns)) >= 0)
+            piped = 1;
+#endif
+        if (n_in < 0 && ImpairProfile != NULL)
+            n_in = impair_pop(msgbuf);
+        int released = n_in >= 0;
+#ifndef _WIN32
+        if (n_in < 0 && draining)
+        {
+            if (Pipe.n_stages > 0 && pipe_flush())
+                continue;
+            if (SendQueueLen > 0)
+                queue_drain();
+            if (FpFile != NULL)
+                fflush(Fp.f);
+            printf("handoff: passing sockets to new instance, exiting\n");
+            HandoffState_t st[HANDOFF_STATES];
+            handoff_states(st);
+            return handoff_send(fd_peer, st);
+        }
+        if (n_in < 0 && (SendQueueLen > 0 || Pipe.n_stages > 0) && loop_wait())
+            continue;
+        if (n_in < 0 && (PcrJitter || CycleAccounting))
+            n_in = recv_input(msgbuf, &rx_ns);
+        else
+#endif
+        if (n_in < 0)
+        n_in = recvfrom(
+            fd_in,
             (char*)msgbuf,
-            n_in,
+            MSGBUFSIZE,
             0,
-            (struct sockaddr*) & addr_out,
-            sizeof(addr_out)
+            (struct sockaddr*) & addr_in,
+            (socklen_t*)&addrlen
         );
-        if (n_out < 0 || n_out != n_in) {
-            perror("sendto");
+        if (n_in < 0) {
+#ifndef _WIN32
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                if (EtrMonitor) {
+                    Etr.now = wall_time();
+                    etr_tick(&Etr);
+                }
+                continue;
+            }
+#endif
+            perror("recvfrom");
             continue;
         }
+        if (ImpairProfile != NULL && !released && (n_in = impair_push(msgbuf, n_in)) < 0)
+            continue;
+#ifndef _WIN32
+        if (Pipe.n_stages > 0 && !piped) {
+            pipe_push(msgbuf, n_in, rx_ns);
+            continue;
+        }
+#endif
+        PROBE1(receive, n_in);
+        stage_mark(STAGE_PARSE, perf_sample, perf_v, stage_tsc);
+
+        //------------------------
+        // compute length, number of TS packets, offset (UDP or RTP)
+
+        int n_ts = n_in / TS_LEN;
+        int ts_length = n_ts * TS_LEN;
+        int ts_offset = n_in - ts_length;
+
+#ifndef _WIN32
+        PcrHit_t pcr_hits[MSGBUFSIZE / TS_LEN];
+        int n_pcr_hits = 0;
+        if (PcrJitter) {
+            if (rx_ns == 0)
+                rx_ns = realtime_ns();
+            n_pcr_hits = jitter_scan(msgbuf + ts_offset, n_ts, pcr_hits);
+        }
+#endif
+
+        //------------------------
+        // Patch PIDs
+
+        stage_mark(STAGE_PATCH, perf_sample, perf_v, stage_tsc);
+        if (FpFile != NULL)
+            fp_input(&Fp, msgbuf + ts_offset, n_ts);
+        if (MipCheck)
+            mip_check(&MipIn, msgbuf + ts_offset, n_ts);
+        if (T2miPid >= 0)
+            t2mi_patch(&T2mi, msgbuf + ts_offset, n_ts);
+        if (PesSpecCount > 0)
+            pes_filter(msgbuf + ts_offset, n_ts);
+        if (EtrMonitor)
+            Etr.now = wall_time();
+        int n_patched = patch_ts(msgbuf + ts_offset, n_ts, Pid2Patch, Pid2PatchCount, &PidStats,
+            EtrMonitor ? &Etr : NULL, FpFile != NULL ? &Fp : NULL);
+        PROBE2(patch, n_ts, n_patched);
+        if (MipCheck)
+            mip_check(&MipOut, msgbuf + ts_offset, n_ts);
+
+        //------------------------
+        // send patched UDP
+
+        stage_mark(STAGE_SEND, perf_sample, perf_v, stage_tsc);
+        int n_out = n_in;
+#ifndef _WIN32
+        if (SendQueueLen > 0) {
+            // the main output decides what counts as sent, a queued
+            // datagram is not sent yet
+            n_out = queue_send(&Queues[0], msgbuf, n_in);
+            for (int q = 1; q < n_queues; q++)
+                queue_send(&Queues[q], msgbuf, n_in);
+        }
+        else
+#endif
+        {
+            n_out = sendto(
+                fd_out,
+                (char*)msgbuf,
+                n_in,
+                0,
+                &addr_out.sa,
+                addr_len(&addr_out)
+            );
+            for (int o = 0; o < OutputCount; o++)
+                if (sendto(Outputs[o].fd, (char*)msgbuf, n_in, 0, &Outputs[o].addr.sa, addr_len(&Outputs[o].addr)) != n_in
+                    && Outputs[o].count_err++ == 0)
+                    perror(Outputs[o].iface);
+        }
+        stage_mark(STAGE_COUNT, perf_sample, perf_v, stage_tsc);
+        if (perf_sample)
+            perf_account(perf_v);
+        if (CycleAccounting)
+            cycles_account(stage_tsc);
+
+        // latency = time between receive and send probes, taken by the tracer
+        PROBE1(send, n_out);
+        int sent = n_out == n_in;
+        if (!sent && SendQueueLen == 0) {
+            perror("sendto");
+            ++Stats.count_send_err;
+        }
+#ifndef _WIN32
+        if (sent && n_pcr_hits > 0)
+            jitter_account(pcr_hits, n_pcr_hits, rx_ns, realtime_ns());
+        if (sent && MonitorSpec != NULL)
+            monitor_send(msgbuf, n_in, ts_offset, n_ts);
+#endif
+
+        //------------------------
+        // stats, off the receive to send path
+
+        Stats.count_patched += n_patched;
+        ++Stats.count_udp;
+        Stats.count_ts += n_ts;
+        if (EtrMonitor)
+            etr_tick(&Etr);
+
+        time_t now;
+        time(&now);
+        int cycles_tick = CycleAccounting && now != last_cycles;
+        if (cycles_tick)
+        {
+            CycleStats.tsc_now = read_tsc();
+            CycleStats.time_now = wall_time();
+            last_cycles = now;
+        }
+#ifndef _WIN32
+        // perf counters move once per sample, TSC shares once per second
+        stats_shm_publish((perf_sample ? STATS_SHM_PERF : 0) | (cycles_tick ? STATS_SHM_CYCLES : 0));
+        stats_shm_history(now);
+#endif
+        if (now - last_display >= 5)
+        {
+            printf("%8llu UDP (%d bytes), %8llu TS, %8llu patched\r", Stats.count_udp, n_in, Stats.count_ts, Stats.count_patched);
+            if (fd_perf >= 0)
+                perf_print();
+            if (CycleAccounting)
+                cycles_print(&CycleStats);
+            if (ImpairProfile != NULL)
+                impair_print();
+            if (Stats.count_send_err > 0)
+                printf("\n  output main: %llu send errors\n", Stats.count_send_err);
+            for (int o = 0; o < OutputCount && SendQueueLen == 0; o++)
+                printf("\n  output %s: %llu send errors\n", Outputs[o].iface, Outputs[o].count_err);
+            if (EtrMonitor)
+                etr_print(&Etr);
+            if (T2miPid >= 0)
+                t2mi_print(&T2mi);
+            if (PesSpecCount > 0)
+                pes_print();
+            if (FpFile != NULL) {
+                printf("\n  fingerprints: %d PIDs, %llu chunks\n", Fp.n_pids, Fp.count_chunks);
+                fflush(Fp.f);
+            }
+            if (MipCheck) {
+                mip_print(&MipIn);
+                mip_print(&MipOut);
+            }
+#ifndef _WIN32
+            if (PcrJitter)
+                jitter_print();
+            if (MonitorSpec != NULL)
+                monitor_print();
+            if (SendQueueLen > 0)
+                queue_print();
+            if (Pipe.n_stages > 0)
+                pipe_print();
+#endif
+            last_display = now;
+        }
     }
 
     return 0;